@@ -12,7 +12,16 @@
 #include "globals.h"
 #include "spi.h"
 #include "dht11.h"
+#include "crc16.h"
+#include "sample.h"
+#include "tdma.h"
+#include "therm_table.h"
+#include "led_anim.h"
+#include "xfer.h"
+#include "flash_log.h"
+#include "series.h"
 #include <stdint.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
@@ -26,15 +35,33 @@
 // 3: length
 // 4-4+length: data
 // 4+length: checksum
+//
+// In crc mode (BULL_CRC set in command), the checksum is replaced by a
+// crc16, low byte first, at 4+length and 5+length.
 
 uint8_t address;
 uint8_t bull_inhibit_response;
+uint8_t bull_command;   // Command of current request, with flags.
+uint8_t bull_crc;       // Current request, and thus reply, uses crc mode.
+uint8_t bull_tagged;    // Current request has a tag to echo in the reply.
+uint8_t bull_tag;       // That tag
+uint8_t bull_nack_code; // Payload of nack. Read by the transmit interrupt.
+uint8_t bull_header[5]; // Header of reply. Read by the transmit interrupt.
+uint8_t bull_chunk[5];  // Transfer id and offset of a chunk. Likewise.
+struct spi_transaction bull_spi;
+
+// Batch read (command 0x11) collects the replies of each read here.
+#define BULL_BATCH_LEN 96
+uint8_t bull_batching;
+uint8_t bull_batch_len;
+uint8_t bull_batch[BULL_BATCH_LEN];
 struct T {
   uint64_t device_id;
   uint64_t discrepancy_mask;
 } therm;
 
 extern uint32_t time_s; // Defined in main.c
+extern uint16_t time_ms;
 void idler(void);       // Defined in main.c
 
 // Strings stored in flash
@@ -48,18 +75,29 @@ const char strINVALID_LENGTH[]        PROGMEM = "Invalid length";
 const char strPROGRAMMING_MODE_FAIL[] PROGMEM = "Failed programming mode";
 const char strLEDREENABLED[]          PROGMEM = "LED output reenabled";
 const char strCOMMUNICATION_ERROR[]   PROGMEM = "Communication error";
+const char strINVALID_BAUDRATE[]      PROGMEM = "Invalid baudrate";
+const char strINVALID_MODE[]          PROGMEM = "Invalid mode";
+const char strINVALID_RESOLUTION[]    PROGMEM = "Invalid resolution";
+const char strINVALID_ALARM[]         PROGMEM = "Invalid alarm limits";
+const char strINVALID_SCENE[]         PROGMEM = "Invalid scene";
+const char strINVALID_TRANSFER[]      PROGMEM = "Invalid transfer";
 const char strLENGTH_MULTIPLE_OF_THREE[] PROGMEM =
   "Length must be a multiple of three";
 
+uint8_t bull_is_crc(uint8_t command);
+uint8_t bull_is_request(uint8_t command);
 int checksum_ok(uint8_t* data, unsigned int length);
 void bull_string_reply(uint8_t command, uint8_t param, const char* str);
 void bull_data_reply(uint8_t command, uint8_t param, uint8_t len,
                      const uint8_t* data);
 void bull_data_reply2(uint8_t command, uint8_t param, uint8_t len1,
                       const uint8_t* data1, uint8_t len2, const uint8_t* data2);
+void bull_version_reply();
 void bull_handle_read(uint8_t param, uint8_t len, const uint8_t* data);
 void bull_handle_write(uint8_t param, uint8_t len, const uint8_t* data);
-void flash_read_page(uint16_t page, uint8_t *buf);
+void bull_handle_batch(uint8_t len, const uint8_t* data);
+void bull_flash_reply(uint8_t page);
+void bull_chunk_replies(const uint8_t* request);
 
 void bull_init() {
   address = eeReadByte(0);
@@ -67,13 +105,23 @@ void bull_init() {
     // When eeprom is cleared, it reads as FF. Set our address to 0 if so.
     address = 0;
   }
+  uart_set_address(address);
+}
+
+uint8_t bull_is_crc(uint8_t command) {
+  // 0xFF is the legacy error reply, and never uses crc.
+  return (command & BULL_CRC) && command != 0xFF;
+}
+
+uint8_t bull_is_request(uint8_t command) {
+  return command != 0xFF && (command & BULL_TYPE) == BULL_REQUEST;
 }
 
 int is_bull(uint8_t* data, unsigned int length) {
   if (length < 5) {
     return 0;
   }
-  if (length >= data[3] + 5) {
+  if (length >= data[3] + 5 + bull_is_crc(data[1])) {
     // The length is correct
     return 1;
   }
@@ -82,20 +130,59 @@ int is_bull(uint8_t* data, unsigned int length) {
 }
 
 void handle_bull(uint8_t* data, unsigned int length) {
+  uint8_t entropy;
+  uint8_t len;
+  const uint8_t* payload;
+
+  bull_command = data[1];
+  bull_crc = bull_is_crc(data[1]);
+  bull_tagged = (data[1] & BULL_TAG) && data[1] != 0xFF;
+  if (bull_tagged && data[3] == 0) {
+    // No room for the tag. Garbage.
+    return;
+  }
+  // The tag is the first byte of the payload. Keep it for the header of the
+  // reply, and hide it from the handlers. The header might still be in use
+  // by the previous reply.
+  bull_tag = data[4];
+  payload = &data[4 + bull_tagged];
+  len = data[3] - bull_tagged;
+
   if (!checksum_ok(data, length)) {
-    if (data[0] == address) {
+    if (data[0] == address && bull_is_request(data[1])) {
       // This is for us, and we are expected to answer something. Error.
-      bull_string_reply(0xFF, 0x00, strBAD_CHECKSUM);
+      bull_inhibit_response = 0;
+      if (bull_crc) {
+        // Short nack that the master can retry on immediately.
+        uart_wait_sent();
+        bull_nack_code = BULL_NACK_CHECKSUM;
+        bull_data_reply(0xFF, 0x00, 1, &bull_nack_code);
+      } else {
+        bull_string_reply(0xFF, 0x00, strBAD_CHECKSUM);
+      }
     }
     return;
   }
 
-  if (data[0] != address && data[0] != 0xFF) {
-    // This is not our addres and not a broadcast message
+  // Any valid frame means we are using the same baudrate as the bus.
+  uart_frame_valid();
 
-    if (data[1] == 0x01 && data[2] == 0x08 && length == 6) {
+  if (!bull_is_request(data[1])) {
+    // A reply from another unit. The uart only lets search replies through.
+    if ((data[1] & BULL_TYPE) == BULL_REPLY && data[2] == 0x08 && len == 1) {
       // Someone else is responding to a search. Store their selected
       // slot for next search.
+      search_add_used(payload[0]);
+    }
+    return;
+  }
+
+  if (data[0] != address && data[0] != 0xFF) {
+    // This is not our addres and not a broadcast message
+
+    if (data[1] == 0x01 && data[2] == 0x08 && data[3] == 1) {
+      // A unit with older firmware, replying with the read command, is
+      // responding to a search. Store their selected slot for next search.
       search_add_used(data[4]);
     }
     return;
@@ -104,13 +191,20 @@ void handle_bull(uint8_t* data, unsigned int length) {
   // We do not want to respond to broadcast
   bull_inhibit_response = (data[0] == 0xFF);
 
+  // Replies are sent from where the data is, often temp. Do not let this
+  // request overwrite it while the previous reply is still being sent.
+  uart_wait_sent();
+
   // Check the command
-  switch(data[1]) {
+  switch(data[1] & ~(BULL_CRC | BULL_TAG)) {
   case 0x01: // read
-    bull_handle_read(data[2], data[3], &data[4]);
+    bull_handle_read(data[2], len, payload);
     break;
   case 0x81: // write
-    bull_handle_write(data[2], data[3], &data[4]);
+    bull_handle_write(data[2], len, payload);
+    break;
+  case 0x11: // batch read
+    bull_handle_batch(len, payload);
     break;
   default:
     bull_string_reply(0xFF, 0x00, strUNHANDLED_COMMAND);
@@ -119,148 +213,185 @@ void handle_bull(uint8_t* data, unsigned int length) {
   // Feed the random pool some entropy based on the 125kHz timer2 after
   // a bull response. Not all units will get the request at all, and during
   // broadcast, we might have somewhat differing clocks since poweron.
-  temp.ui8 = TCNT2;
-  rnd_feed(&temp.ui8, 1);
+  // Do not use temp. The reply might still be sent from it.
+  entropy = TCNT2;
+  rnd_feed(&entropy, 1);
 }
 
 int checksum_ok(uint8_t* data, unsigned int length) {
   unsigned int i = 0;
   uint8_t sum = 0;
+  if (bull_crc) {
+    return crc16(data, length - 2) ==
+      (data[length-2] | (data[length-1] << 8));
+  }
   for (i = 0; i < length - 1; i++) {
     sum += data[i]; // Sum with overflow
   }
   return sum == data[length-1];
 }
 
-void bull_string_reply(uint8_t command, uint8_t param, const char* str) {
-  if (bull_inhibit_response) {
-    // We do not want to respond to broadcasts
+void bull_batch_add(uint8_t command, uint8_t param,
+                    const struct uart_part* parts, uint8_t count) {
+  // Append a reply to the batch as parameter, status, length and data.
+  uint8_t i;
+  uint8_t len = 0;
+  uint8_t *p;
+
+  for (i = 1; i < count - 1; i++) {
+    len += parts[i].len;
+  }
+  if (bull_batch_len + 3 > BULL_BATCH_LEN) {
+    // Not even room for the status. The master will see it missing.
     return;
   }
-  unsigned int i;
-  uint8_t sum = 0;
-  char c;
-  uart_putc(address);
-  sum += address;
 
-  uart_putc(command);
-  sum += command;
-
-  uart_putc(param);
-  sum += param;
-
-  i = 0;
-  // Calculate length from progmem
-  while(pgm_read_byte(&(str[i])) != 0 && i < 255) {
-    i++;
-  }
-  uart_putc(i);
-  sum += i;
-
-  // Add data from progmem
-  i = 0;
-  c = pgm_read_byte(&(str[i]));
-  while(c) {
-    uart_putc(c);
-    sum += (c);
-    i++;
-    c = pgm_read_byte(&(str[i]));
+  p = &bull_batch[bull_batch_len];
+  p[0] = param;
+  p[1] = command == 0xFF ? BULL_BATCH_ERROR : BULL_BATCH_OK;
+  p[2] = 0;
+  bull_batch_len += 3;
+  if (bull_batch_len + len > BULL_BATCH_LEN) {
+    p[1] = BULL_BATCH_NO_ROOM;
+    return;
   }
+  p[2] = len;
 
-  uart_putc(sum);
+  for (i = 1; i < count - 1; i++) {
+    if (parts[i].type == UART_PGM) {
+      memcpy_P(&bull_batch[bull_batch_len], parts[i].data, parts[i].len);
+    } else {
+      memcpy(&bull_batch[bull_batch_len], parts[i].data, parts[i].len);
+    }
+    bull_batch_len += parts[i].len;
+  }
 }
 
-void bull_data_reply(uint8_t command, uint8_t param, uint8_t len,
-                     const uint8_t* data) {
+void bull_send(uint8_t command, uint8_t param, struct uart_part* parts,
+               uint8_t count) {
+  // Send a reply with header and checksum around the payload in
+  // parts[1..count-2]. parts[0] and parts[count-1] are filled in here.
+  // The payload is read by the transmit interrupt after we return.
+  // command is 0xFF for errors. Otherwise the reply command is made from
+  // the request command.
+  uint8_t i;
+  uint8_t len = 0;
+  if (bull_batching) {
+    bull_batch_add(command, param, parts, count);
+    return;
+  }
   if (bull_inhibit_response) {
     // We do not want to respond to broadcasts
     return;
   }
-  unsigned int i;
-  uint8_t sum = 0;
-  uart_putc(address);
-  sum += address;
 
-  uart_putc(command);
-  sum += command;
+  // The header of the previous reply might still be in use.
+  uart_wait_sent();
 
-  uart_putc(param);
-  sum += param;
+  for (i = 1; i < count - 1; i++) {
+    len += parts[i].len;
+  }
+  // Reply with the same flags as the request.
+  if (command != 0xFF) {
+    command = (bull_command & ~BULL_TYPE) | BULL_REPLY;
+  } else if (bull_command != 0x01 && bull_command != 0x81) {
+    command = bull_command | BULL_ERROR;
+  } // else the legacy error 0xFF
+
+  bull_header[0] = address;
+  bull_header[1] = command;
+  bull_header[2] = param;
+  bull_header[3] = len + bull_tagged;
+  bull_header[4] = bull_tag;
+
+  parts[0].data = bull_header;
+  parts[0].len = 4 + bull_tagged;
+  parts[0].type = UART_RAM;
+  parts[count-1].type = bull_crc ? UART_CRC : UART_SUM;
+
+  if (bull_tagged && uart_mode() != UART_MODE_9BIT) {
+    // The master might have other requests in flight. Do not talk over
+    // someone else. In 9 bit mode we cannot hear the others, and the master
+    // spaces the requests instead.
+    while (uart_quiet_ms() < BULL_QUIET_MS) {
+      ;
+    }
+  }
 
-  uart_putc(len);
-  sum += len;
+  uart_send(parts, count);
+}
 
-  for (i = 0; i < len; i++) {
-    uart_putc(data[i]);
-    sum += data[i];
-  }
+void bull_string_reply(uint8_t command, uint8_t param, const char* str) {
+  struct uart_part parts[3];
+  parts[1].data = (const uint8_t*)str;
+  parts[1].len = strnlen_P(str, 255);
+  parts[1].type = UART_PGM;
+  bull_send(command, param, parts, 3);
+}
 
-  uart_putc(sum);
+void bull_data_reply(uint8_t command, uint8_t param, uint8_t len,
+                     const uint8_t* data) {
+  bull_data_reply2(command, param, len, data, 0, 0);
 }
 
 void bull_data_reply2(uint8_t command, uint8_t param,
                       uint8_t len1, const uint8_t* data1,
                       uint8_t len2, const uint8_t* data2) {
-  if (bull_inhibit_response) {
-    // We do not want to respond to broadcasts
-    return;
-  }
-  unsigned int i;
-  uint8_t sum = 0;
-  uart_putc(address);
-  sum += address;
-
-  uart_putc(command);
-  sum += command;
-
-  uart_putc(param);
-  sum += param;
-
-  uart_putc(len1 + len2);
-  sum += len1 + len2;
-
-  for (i = 0; i < len1; i++) {
-    uart_putc(data1[i]);
-    sum += data1[i];
-  }
+  struct uart_part parts[4];
+  parts[1].data = data1;
+  parts[1].len = len1;
+  parts[1].type = UART_RAM;
+  parts[2].data = data2;
+  parts[2].len = len2;
+  parts[2].type = UART_RAM;
+  bull_send(command, param, parts, 4);
+}
 
-  for (i = 0; i < len2; i++) {
-    uart_putc(data2[i]);
-    sum += data2[i];
-  }
+void bull_version_reply() {
+  struct uart_part parts[3];
+  parts[1].data = (const uint8_t*)version_string();
+  parts[1].len = version_length();
+  parts[1].type = UART_PGM;
+  bull_send(0x01, 0x06, parts, 3); // Command = read, parameter = 0x06
+}
 
-  uart_putc(sum);
+void bull_flash_reply(uint8_t page) {
+  // Send a page of flash directly from PROGMEM.
+  struct uart_part parts[3];
+  parts[1].data = (const uint8_t*)((uint16_t)page * SPM_PAGESIZE);
+  parts[1].len = SPM_PAGESIZE;
+  parts[1].type = UART_PGM;
+  bull_send(0x01, 0x09, parts, 3);
 }
 
-void bull_version_reply() {
-  if (bull_inhibit_response) {
-    // We do not want to respond to broadcasts
+void bull_chunk_replies(const uint8_t* request) {
+  // Send the chunks asked for, one reply each. See xfer.h.
+  struct uart_part parts[4];
+  uint8_t id = request[0];
+  uint8_t object = request[1];
+  uint8_t count = request[6];
+  uint32_t offset;
+
+  memcpy(&offset, &request[2], 4);
+  if (!xfer_readable(object) || count == 0 || count > XFER_WINDOW) {
+    bull_string_reply(0xFF, 0x30, strINVALID_TRANSFER);
     return;
   }
-  uint8_t i;
-  uint8_t length;
-  uint8_t sum = 0;
-  uint8_t c;
-  uart_putc(address);
-  sum += address;
-
-  uart_putc(0x01); // Command = read
-  sum += 0x01;
-
-  uart_putc(0x06); // Parameter = 0x06
-  sum += 0x06;
-
-  length = version_length();
-  uart_putc(length);
-  sum += length;
-
-  for (i = 0; i < length; i++) {
-    c = version_char(i);
-    uart_putc(c);
-    sum += c;
+  while (count--) {
+    // The previous chunk is sent from bull_chunk, and maybe temp.buf.
+    uart_wait_sent();
+    xfer_read(object, offset, XFER_CHUNK, &parts[2]);
+    bull_chunk[0] = id;
+    memcpy(&bull_chunk[1], &offset, 4);
+    parts[1].data = bull_chunk;
+    parts[1].len = 5;
+    parts[1].type = UART_RAM;
+    bull_send(0x01, 0x30, parts, 4);
+    if (parts[2].len < XFER_CHUNK) {
+      break; // The end
+    }
+    offset += XFER_CHUNK;
   }
-
-  uart_putc(sum);
 }
 
 uint8_t bull_verify_length(uint8_t param, uint8_t supplied, uint8_t expected) {
@@ -289,8 +420,11 @@ void bull_handle_read(uint8_t param, uint8_t len, const uint8_t* data) {
     eeReadBlock((void*)1, temp.buf, 15);
     bull_data_reply(0x01, param, 15, temp.buf);
   } else if (param == 0x05) {
-    // Time
-    bull_data_reply(0x01, param, 4, (uint8_t*)&time_s);
+    // Time. Copy it, as it is updated by the timer interrupt while sending.
+    cli();
+    temp.ui32 = time_s;
+    sei();
+    bull_data_reply(0x01, param, 4, (uint8_t*)&temp.ui32);
   } else if (param == 0x06) {
     // Version
     bull_version_reply();
@@ -318,11 +452,8 @@ void bull_handle_read(uint8_t param, uint8_t len, const uint8_t* data) {
     // 512 bytes of the 32k Flash, ie from byte 32256-32767. Supply page
     // 252 to read the first 128 byte block of the boot loader.
     if (bull_verify_length(param, len, 1)) {
-      // Use the serial buffer to store the read data. It is large enough,
-      // 128 bytes. Also, we know that the main loop is not using it, as
-      // we are called with it.
-      flash_read_page(data[0], serialbuffer);
-      bull_data_reply(0x01, param, 128, serialbuffer);
+      // The page is sent straight from flash by the transmit interrupt.
+      bull_flash_reply(data[0]);
     }
   } else if (param == 0x0A) {
     // Read chip info.
@@ -338,9 +469,42 @@ void bull_handle_read(uint8_t param, uint8_t len, const uint8_t* data) {
     temp.buf[7] = boot_signature_byte_get(1); // RC Calibration
     bull_data_reply(0x01, param, 8, temp.buf);
   } else if (param == 0x0B) {
-    // Read SPI == enable LED output again.
-    spi_disable();
+    // The SPI is turned off by itself when done, which enables the LED.
     bull_string_reply(0x01, param, strLEDREENABLED);
+  } else if (param == 0x0C) {
+    // Baudrate
+    temp.ui32 = uart_baud();
+    bull_data_reply(0x01, param, 4, (uint8_t*)&temp.ui32);
+  } else if (param == 0x0D) {
+    // Line mode
+    temp.ui8 = uart_mode();
+    bull_data_reply(0x01, param, 1, &temp.ui8);
+  } else if (param == 0x0E) {
+    // Led brightness
+    temp.ui8 = wsled_brightness();
+    bull_data_reply(0x01, param, 1, &temp.ui8);
+  } else if (param == 0x0F) {
+    // Led animation scene, empty if stopped
+    bull_data_reply(0x01, param, anim_scene_len, (uint8_t*)&anim_scene);
+  } else if (param == 0x30) {
+    // Chunked read: id, object, offset, chunks
+    if (bull_verify_length(param, len, 7)) {
+      bull_chunk_replies(data);
+    }
+  } else if (param == 0x31) {
+    // Chunked write window
+    bull_data_reply(0x01, param, sizeof(xfer_status), (uint8_t*)&xfer_status);
+  } else if (param == 0x32) {
+    // Flash log range and period
+    flash_log_info((struct flash_log_info*)temp.buf);
+    bull_data_reply(0x01, param, sizeof(struct flash_log_info), temp.buf);
+  } else if (param == 0x33) {
+    // Time series range
+    series_info((struct series_header*)temp.buf);
+    bull_data_reply(0x01, param, sizeof(struct series_header), temp.buf);
+  } else if (param == 0x34) {
+    // Time series period per channel
+    bull_data_reply(0x01, param, SERIES_CHANNELS, series_periods);
   } else if (param >= 0x10 && param < 0x20) {
     // EEPROM parameters
     temp.ui8 = eeReadByte((void*)(0x10) + param);
@@ -353,32 +517,116 @@ void bull_handle_read(uint8_t param, uint8_t len, const uint8_t* data) {
     if (len == 8) {
       therm.device_id = *((uint64_t*)data);
     }
-    therm_read_temperature(&temp.i16, &therm.device_id);
-    bull_data_reply2(0x01, param,
-                     2, (uint8_t*)&temp.i16,
-                     8, (uint8_t*)&therm.device_id);
+    // Answered from the table kept by the background sampling.
+    therm_table_get(&therm.device_id, (struct therm_entry*)temp.buf);
+    bull_data_reply(0x01, param, sizeof(struct therm_entry), temp.buf);
     if (len == 1) {
-      therm.device_id = therm_search(&therm.discrepancy_mask);
+      // Search while the reply is sent. The reply is in temp.buf.
+      uint64_t next = therm_search(&therm.discrepancy_mask);
+      if (THERM_ID_VALID(next)) {
+        therm_table_add(&next, therm_bus);
+      }
+      therm.device_id = next;
     }
   } else if (param == 0x23) {
     // Read DS18B20 bit
     temp.ui8 = therm_read_bit();
     bull_data_reply(0x01, param, 1, &temp.ui8);
   } else if (param == 0x24) {
-    // Read DHT 11 data
-    len = dht_read(temp.buf); // Steal variable 'len' for other stuff
-    if (len) {
-      bull_data_reply(0xFF, param, 1, &len);
-      //bull_string_reply(0xFF, param, strCOMMUNICATION_ERROR);
+    // DHT data, read in the background, and its age
+    if (dht_age() == DHT_AGE_UNKNOWN) {
+      // Never read. Say why, or DHT_BUSY if the first read is running.
+      temp.ui8 = dht_status(); // Reply is sent after we return. Not from
+                               // the stack.
+      bull_data_reply(0xFF, param, 1, &temp.ui8);
       return;
     }
-    bull_data_reply(0x01, param, 4, temp.buf);
+    dht_data(temp.buf);
+    *((uint16_t*)&temp.buf[4]) = dht_age(); // Over the checksum
+    bull_data_reply(0x01, param, 6, temp.buf);
+  } else if (param == 0x25) {
+    // Latched sample
+    bull_data_reply(0x01, param, sizeof(sample), (uint8_t*)&sample);
+  } else if (param == 0x26) {
+    // Tdma config
+    len = tdma_get_config(temp.buf); // Steal variable 'len' for other stuff
+    bull_data_reply(0x01, param, len, temp.buf);
+  } else if (param == 0x28) {
+    // DS18B20 sampling period
+    temp.ui8 = therm_table_period();
+    bull_data_reply(0x01, param, 1, &temp.ui8);
+  } else if (param == 0x29) {
+    // DS18B20 rom list. Left alone until the next enumeration, which waits
+    // for this reply to be sent.
+    bull_data_reply(0x01, param, 8 * therm_table_len, (uint8_t*)therm_ids);
+  } else if (param == 0x2A) {
+    // DS18B20 temperatures. The sampling might update them while sent.
+    len = therm_table_len * sizeof(struct therm_value);
+    memcpy(temp.buf, therm_values, len);
+    bull_data_reply(0x01, param, len, temp.buf);
+  } else if (param == 0x2B) {
+    // DS18B20 resolutions
+    bull_data_reply(0x01, param, therm_table_len, therm_bits);
+  } else if (param == 0x2C) {
+    // DS18B20 alarm limits
+    bull_data_reply(0x01, param,
+                    therm_table_len * sizeof(struct therm_alarm),
+                    (uint8_t*)therm_alarms);
+  } else if (param == 0x2D) {
+    // DS18B20 sensors in alarm at the last search, as many as temp.buf
+    // holds after the age. Start the next search.
+    *((uint16_t*)temp.buf) = therm_table_alarms_age();
+    len = therm_table_alarms((struct therm_entry*)&temp.buf[2],
+                             (sizeof(temp.buf) - 2) /
+                             sizeof(struct therm_entry));
+    therm_table_start_alarms();
+    bull_data_reply(0x01, param, 2 + len * sizeof(struct therm_entry),
+                    temp.buf);
+  } else if (param == 0x2E) {
+    // DS18B20 read errors
+    bull_data_reply(0x01, param, therm_table_len, therm_errors);
   } else {
     // Invalid parameter
     bull_string_reply(0xFF, param, strINVALID_PARAMETER);
   }
 }
 
+void bull_handle_batch(uint8_t len, const uint8_t* data) {
+  // Payload is a list of (parameter, length, payload) reads. Run each one
+  // through the normal read handling and reply with all results at once.
+  uint16_t i;
+  uint8_t inhibit = bull_inhibit_response;
+
+  for (i = 0; i + 2 <= len; i += 2 + data[i+1]) {
+    ; // Verify that the list adds up before running anything.
+  }
+  if (i != len) {
+    bull_string_reply(0xFF, 0x00, strINVALID_LENGTH);
+    return;
+  }
+
+  bull_batch_len = 0;
+  bull_batching = 1;
+  for (i = 0; i < len; i += 2 + data[i+1]) {
+    bull_handle_read(data[i], data[i+1], &data[i+2]);
+  }
+  bull_batching = 0;
+
+  // Reads such as search may change this. The batch is a single reply.
+  bull_inhibit_response = inhibit;
+  bull_data_reply(0x11, 0x00, bull_batch_len, bull_batch);
+}
+
+void bull_report(const uint8_t* list, uint8_t len, uint8_t crc) {
+  // Not a reply to a request. Set up as if the master asked for it.
+  uart_wait_sent();
+  bull_command = crc ? 0x11 | BULL_CRC : 0x11;
+  bull_crc = crc;
+  bull_tagged = 0;
+  bull_inhibit_response = 0;
+  bull_handle_batch(len, list);
+}
+
 void ignore_traffic() {
   // Ignore traffic until we receive no traffic within 5 seconds
 
@@ -386,11 +634,12 @@ void ignore_traffic() {
   eeWriteByte((void*)0x10, 1);
 
   morse_say_P(strDEAF);
-  uint8_t *c = &address; // Initiate with any address.
-  while (c) {
-    c = uart_getc(5000, idler);
-    wdt_reset();
-  }
+  do {
+    // Drop everything the uart assembles while we are deaf. In 9 bit mode
+    // this also leaves only address bytes to wake us.
+    uart_flush();
+    idler();
+  } while (uart_quiet_ms() < 5000);
   morse_say_P(strLISTENING);
 
   eeWriteByte((void*)0x10, 0); // No longer quiet.
@@ -412,6 +661,7 @@ void bull_handle_write(uint8_t param, uint8_t len, const uint8_t* data) {
     }
     address = data[0];
     eeWriteByte((uint8_t*)0, address);
+    uart_set_address(address);
     bull_data_reply(0x81, param, 0, 0);
   } else if (param == 0x02) {
     // Name
@@ -439,18 +689,26 @@ void bull_handle_write(uint8_t param, uint8_t len, const uint8_t* data) {
   } else if (param == 0x05) {
     // Time
     if (bull_verify_length(param, len, 4)) {
+      // Start the second now too, so units set by broadcast agree on when
+      // the seconds change.
+      cli();
       time_s = *((uint32_t*)(data)); // Cast the four bytes to an int.
+      time_ms = 0;
+      sei();
       bull_data_reply(0x81, param, 0, 0);
     }
   } else if (param == 0x07) {
-    // NeoPixel write
-    if(len == 0 || (len % 3) != 0) {
+    // NeoPixel write, into the frame buffer. Sent from the main loop.
+    anim_stop();
+    if (len % 3 == 1) {
+      // Starting at a led index
+      wsled_set(data[0], &data[1], len / 3);
+    } else if (len != 0 && len % 3 == 0) {
+      wsled_set(0, data, len / 3);
+    } else {
       bull_string_reply(0xFF, param, strLENGTH_MULTIPLE_OF_THREE);
       return;
     }
-    for(i = 0; i < len; i += 3) {
-      wsled_color(data[i], data[i+1], data[i+2]);
-    }
     bull_string_reply(0x81, param, strOK);
   } else if (param == 0x08) {
     // Start new search
@@ -459,10 +717,77 @@ void bull_handle_write(uint8_t param, uint8_t len, const uint8_t* data) {
       bull_data_reply(0x81, param, 0, 0); // Will probably be inhibited.
     }
   } else if (param == 0x0B) {
-    // SPI
-    spi_send(data, len);
-    spi_busywait_until_done();
-    bull_data_reply(0x81, param, spi_bytes_in_rx_buf, spi_buf_rx);
+    // SPI, on /SS at f/16 in mode 0
+    if (len > MAX_TEMP_BUF) {
+      bull_string_reply(0xFF, param, strINVALID_LENGTH);
+    } else {
+      bull_spi.cs = SPI_CS_SS;
+      bull_spi.mode = 0;
+      bull_spi.divider = SPI_DIV_16;
+      bull_spi.segments[0].tx = data;
+      bull_spi.segments[0].rx = temp.buf;
+      bull_spi.segments[0].len = len;
+      bull_spi.segments[1].len = 0;
+      bull_spi.done = 0;
+      spi_submit(&bull_spi);
+      spi_wait(&bull_spi);
+      bull_data_reply(0x81, param, len, temp.buf);
+    }
+  } else if (param == 0x0C) {
+    // Baudrate. Reply on the old rate, then switch. Usually broadcast.
+    if (bull_verify_length(param, len, 4)) {
+      temp.ui32 = *((uint32_t*)(data));
+      if (!uart_baud_valid(temp.ui32)) {
+        bull_string_reply(0xFF, param, strINVALID_BAUDRATE);
+        return;
+      }
+      bull_data_reply(0x81, param, 0, 0);
+      uart_set_baud(temp.ui32);
+    }
+  } else if (param == 0x0D) {
+    // Line mode. Reply in the old mode, then switch. Usually broadcast.
+    if (bull_verify_length(param, len, 1)) {
+      if (data[0] != UART_MODE_8BIT && data[0] != UART_MODE_9BIT) {
+        bull_string_reply(0xFF, param, strINVALID_MODE);
+        return;
+      }
+      bull_data_reply(0x81, param, 0, 0);
+      uart_set_mode(data[0]);
+    }
+  } else if (param == 0x0E) {
+    // Led brightness
+    if (bull_verify_length(param, len, 1)) {
+      wsled_set_brightness(data[0]);
+      bull_data_reply(0x81, param, 0, 0);
+    }
+  } else if (param == 0x0F) {
+    // Led animation scene
+    if (anim_start(data, len)) {
+      bull_string_reply(0xFF, param, strINVALID_SCENE);
+      return;
+    }
+    bull_data_reply(0x81, param, 0, 0);
+  } else if (param == 0x30) {
+    // Chunked write: id, object, offset, data. Never replied, so that a
+    // window of chunks can be sent back to back. See 0x31.
+    bull_inhibit_response = 1;
+    if (len >= 6) {
+      uint32_t offset;
+      memcpy(&offset, &data[2], 4);
+      xfer_write(data[0], data[1], offset, &data[6], len - 6);
+    }
+  } else if (param == 0x32) {
+    // Flash log period
+    if (bull_verify_length(param, len, 2)) {
+      flash_log_set_period(*((uint16_t*)data));
+      bull_data_reply(0x81, param, 0, 0);
+    }
+  } else if (param == 0x34) {
+    // Time series period per channel
+    if (bull_verify_length(param, len, SERIES_CHANNELS)) {
+      series_set_periods(data);
+      bull_data_reply(0x81, param, 0, 0);
+    }
   } else if (param >= 0x10 && param < 0x20) {
     // EEPROM parameters
     if(bull_verify_length(param, len, 1)) {
@@ -479,21 +804,90 @@ void bull_handle_write(uint8_t param, uint8_t len, const uint8_t* data) {
       therm.discrepancy_mask=0;
     }
     therm.device_id = therm_search(&therm.discrepancy_mask);
+    if (THERM_ID_VALID(therm.device_id)) {
+      // Found one. Sample it in the background from now on.
+      therm_table_add(&therm.device_id, therm_bus);
+    }
     bull_data_reply(0x81, 0x20, 16, (uint8_t*)&therm);
   } else if (param == 0x23) {
     for (i = 0; i < len; i++) {
       therm_write_bit(data[0]);
     }
-    bull_data_reply(0x81, param, 1, (uint8_t*)&i);
+    temp.ui8 = i;
+    bull_data_reply(0x81, param, 1, &temp.ui8);
+  } else if (param == 0x25) {
+    // Sample all sensors now. Usually broadcast. Optional DS18B20 id.
+    if (len == 8) {
+      sample_trigger(data);
+    } else if (bull_verify_length(param, len, 0)) {
+      sample_trigger(0);
+    } else {
+      return;
+    }
+    bull_data_reply(0x81, param, 0, 0);
+  } else if (param == 0x26) {
+    // Tdma config: slot, list of reads
+    if (len == 0) {
+      bull_string_reply(0xFF, param, strINVALID_LENGTH);
+      return;
+    }
+    tdma_set_config(data, len);
+    bull_data_reply(0x81, param, 0, 0);
+  } else if (param == 0x27) {
+    // Tdma cycle start. Reply first, as the report comes later.
+    if (bull_verify_length(param, len, 1)) {
+      bull_data_reply(0x81, param, 0, 0);
+      tdma_cycle(data[0], bull_crc);
+    }
+  } else if (param == 0x28) {
+    // DS18B20 sampling period
+    if (bull_verify_length(param, len, 1)) {
+      therm_table_set_period(data[0]);
+      bull_data_reply(0x81, param, 0, 0);
+    }
+  } else if (param == 0x29) {
+    // Enumerate DS18B20 sensors
+    if (bull_verify_length(param, len, 0)) {
+      temp.ui8 = therm_table_enumerate();
+      bull_data_reply(0x81, param, 1, &temp.ui8);
+    }
+  } else if (param == 0x2B) {
+    // DS18B20 resolution: bits, with 0x80 set to copy to the sensor's
+    // eeprom. Optionally followed by the id of one sensor.
+    if (len != 1 && len != 9) {
+      bull_string_reply(0xFF, param, strINVALID_LENGTH);
+      return;
+    }
+    i = data[0] & 0x7F;
+    if (i < 9 || i > 12) {
+      bull_string_reply(0xFF, param, strINVALID_RESOLUTION);
+      return;
+    }
+    temp.ui8 = therm_table_set_resolution(len == 9 ? (uint64_t*)&data[1] : 0,
+                                          i, data[0] & 0x80);
+    bull_data_reply(0x81, param, 1, &temp.ui8);
+  } else if (param == 0x2C) {
+    // DS18B20 alarm limits: high, low, 1 to copy to the sensor's eeprom.
+    // Optionally followed by the id of one sensor.
+    if (len != 3 && len != 11) {
+      bull_string_reply(0xFF, param, strINVALID_LENGTH);
+      return;
+    }
+    if ((int8_t)data[0] < (int8_t)data[1]) {
+      bull_string_reply(0xFF, param, strINVALID_ALARM);
+      return;
+    }
+    temp.ui8 = therm_table_set_alarm(len == 11 ? (uint64_t*)&data[3] : 0,
+                                     data[0], data[1], data[2]);
+    bull_data_reply(0x81, param, 1, &temp.ui8);
+  } else if (param == 0x2E) {
+    // Clear DS18B20 read errors
+    if (bull_verify_length(param, len, 0)) {
+      therm_table_clear_errors();
+      bull_data_reply(0x81, param, 0, 0);
+    }
   } else {
     // Invalid parameter
     bull_string_reply(0xFF, param, strINVALID_PARAMETER);
   }
 }
-
-void flash_read_page(uint16_t page, uint8_t *buf) {
-  uint16_t i;
-  for(i=0; i < SPM_PAGESIZE; i++) {
-    buf[i] = pgm_read_byte((void*)(page*SPM_PAGESIZE+i));
-  }
-}
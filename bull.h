@@ -1,6 +1,52 @@
 #ifndef BULL_H__
 #define BULL_H__
 
+#include <stdint.h>
+
+// Commands
+//
+// Requests:
+// 0x01 Read
+// 0x81 Write
+// 0x11 Batch read. Payload is a list of (parameter, length, payload) reads.
+//      Reply (parameter 0x00) has one (parameter, status, length, data)
+//      entry per reply the reads produced, status being BULL_BATCH_*. Reads
+//      that do not reply (eg search) have no entry.
+//
+// The low two bits of the command tell the type of frame. The reply to a
+// request has the same command, but of type BULL_REPLY, ie 0x02 for read,
+// 0x82 for write. Errors have type BULL_ERROR, except that errors to plain
+// 0x01 and 0x81 requests are 0xFF, which is also what older firmware sends.
+// Units ignore anything but requests, except for search replies.
+#define BULL_TYPE    0x03
+#define BULL_REQUEST 0x01
+#define BULL_REPLY   0x02
+#define BULL_ERROR   0x03
+//
+// Crc mode: Setting BULL_CRC in the command (0x41 read, 0xC1 write) replaces
+// the 8 bit checksum with a crc16 (Modbus), low byte first. The reply uses
+// the same mode. A crc mode request addressed to us with a bad crc gets an
+// error reply for parameter 0x00 with a single byte BULL_NACK_* code as
+// payload, which the master can retry on at once. Legacy frames are always
+// accepted.
+#define BULL_CRC 0x40
+//
+// Tags: Setting BULL_TAG in the command makes the first payload byte a tag,
+// which is echoed as first payload byte of the reply. The master can then
+// have requests to several units in flight and match the replies. Replies
+// to tagged requests wait for the bus to be quiet for BULL_QUIET_MS, except
+// in 9 bit mode, where the master has to space the requests.
+#define BULL_TAG 0x20
+#define BULL_QUIET_MS 2
+//
+// 0xFF is never a crc or tagged frame.
+
+#define BULL_NACK_CHECKSUM 0x01
+
+#define BULL_BATCH_OK      0x00 // Data is the normal reply payload
+#define BULL_BATCH_ERROR   0x01 // Data is the error reply payload
+#define BULL_BATCH_NO_ROOM 0x02 // Reply did not fit, read it separately
+
 // Parameters
 //
 // 0x01 Address of unit. Read with any payload blink id on led. R/W
@@ -9,11 +55,30 @@
 // 0x04 Go into programming mode (optiboot), W
 // 0x05 Time in seconds, 32 bit, R/W
 // 0x06 Version, R
-// 0x07 NeoPixel write, W
+// 0x07 NeoPixel write, W. Red, green, blue per led, optionally after the
+//      index of the first led to set. Leds not given keep their color.
 // 0x08 Search xBull units, R/W (see search.h for explanation)
 // 0x09 Read flash page, R.
 // 0x0A Read chip info, R. Fuses(L, H, E, lock), Signature, Calibration
-// 0x0B SPI, at most 4 bytes, R/W (Read to reenable LED and disable SPI)
+// 0x0B SPI, at most 64 bytes, R/W. Write sends the bytes with /SS low, at
+//      f/16 in mode 0, and replies with the bytes received. Read is kept for
+//      old clients: the LED comes back by itself when the SPI is idle.
+// 0x0C Baudrate, 32 bit, R/W. Must divide F_CPU/8 by at most 4096, like
+//      250000, 500000 or 1000000 at 16MHz, or be the default 19200. Stored
+//      in eeprom. Replies before switching. Falls back to 19200 if no valid
+//      frame arrives for 10 s, and back again after another 10 s.
+// 0x0D Line mode, 1 byte, R/W. 0 is 8N1, 1 is 9 data bits with the 9th bit
+//      set only on the address byte of requests. In 9 bit mode the uart of
+//      a unit only wakes it for address bytes (MPCM) until a request for it
+//      or broadcast comes. Tagged replies do not wait for a quiet bus, and
+//      units stay awake after a search request to hear the replies. Stored
+//      and falls back like the baudrate.
+// 0x0E Led brightness, 0-255, R/W. Stored in eeprom. Applied with gamma
+//      when the leds are sent.
+// 0x0F Led animation, R/W. Effect, leds, period in ms (16 bit), start
+//      time_s (32 bit, 0 for now), then 2-4 colors as red, green, blue.
+//      Effect 0 alone stops. Usually broadcast. See led_anim.h. A write of
+//      0x07 also stops the animation.
 // 0x10 |
 // ...  | eeprom stored bytes, R/W
 // 0x1F |
@@ -21,11 +86,55 @@
 // 0x21 Search next unit on 1-wire network. Supply 1 to start new search. Read
 //      To return last found / currently active device id.
 // 0x22 Read temperature. Input: device, 0x01 for search next after reply or
-//      nothing to return same as last.
+//      nothing to return same as last. Answered from the table of sampled
+//      sensors (see therm_table.h): temperature, device, age in seconds. A
+//      device not in the table is added, and has age 0xFFFF until sampled.
 // 0x23 Onewire bit, R/W.
-// 0x24 Read DHT11, R.
+// 0x24 DHT11/DHT22, R: the 4 data bytes of the last good read (see
+//      dht11.h) and its age in seconds. Read in the background, see
+//      dht_poll(). Error reply with the dht status if never read.
+// 0x25 Sample. Write (usually broadcast) to sample DS18B20, DHT11 and ADC7
+//      at once, optionally with a DS18B20 id. Read to get the latched
+//      result, see sample.h: time_s, status, temperature, dht, adc.
+// 0x26 Tdma config: slot, list of reads to report. R/W. See tdma.h.
+// 0x27 Tdma cycle start, W (broadcast). Payload: slot length in ms.
+// 0x28 DS18B20 sampling period in seconds, R/W. 0 is off. See therm_table.h.
+// 0x29 DS18B20 rom list, R: 8 bytes per sensor. W without payload to search
+//      the whole bus and store the list. Replies with the number found.
+// 0x2A DS18B20 temperatures, R: temperature and age, 2 bytes each, per
+//      sensor in rom list order.
+// 0x2B DS18B20 resolution, 9-12 bits. R: per sensor in rom list order, 0 if
+//      not known yet. W: bits (| 0x80 to also copy to the sensor's eeprom),
+//      optionally followed by a device to set only that one. Replies with
+//      the number of sensors set.
+// 0x2C DS18B20 alarm limits in whole degrees. R: high and low per sensor in
+//      rom list order, 0 until read. W: high, low, 1 to also copy to the
+//      sensor's eeprom, optionally followed by a device to set only that one.
+//      Replies with the number of sensors set.
+// 0x2D DS18B20 sensors in alarm, R. Starts a conversion and alarm search in
+//      the background, and replies with the result of the last one: its age
+//      in seconds (16 bit, 0xFFFF if none yet), then as 0x22 for each sensor
+//      at or outside its limits, at most 5. Read again after a second for
+//      the new result.
+// 0x2E DS18B20 failed reads (bad crc or no answer), R: per sensor in rom list
+//      order, saturating at 255. W without payload to clear.
+// 0x30 Chunked transfer of large objects, R/W. See xfer.h. R: id, object,
+//      offset (32 bit), number of chunks. Replies with one frame per chunk:
+//      id, offset, data. W: id, object, offset, data. Not replied to.
+// 0x31 Chunked write window, R: id, error, first offset, bitmap of chunks
+//      received.
+// 0x32 Flash log, R/W. R: first and next sequence number, size in records
+//      (32 bit each, size 0 without a chip) and period. W: period in seconds
+//      (16 bit), 0 for off. Stored in eeprom. Records are read as transfer
+//      object 2, see flash_log.h.
+// 0x33 Time series, R: first and next sequence number (32 bit each). The
+//      entries are read as transfer object 3, see series.h.
+// 0x34 Time series period per channel in seconds, 0 for off, R/W. Stored in
+//      eeprom.
 void bull_init();
 int is_bull(unsigned char* data, unsigned int length);
 void handle_bull(unsigned char* data, unsigned int length);
 void ignore_traffic();
+// Send the replies to a list of reads unasked, as a batch reply.
+void bull_report(const uint8_t* list, uint8_t len, uint8_t crc);
 #endif
@@ -1,20 +1,75 @@
 #!/usr/bin/python3
 
 from argparse import ArgumentParser
-from serial import Serial
+from serial import Serial, PARITY_NONE, PARITY_MARK, PARITY_SPACE
 from binascii import hexlify
 from datetime import datetime
 
 import time
 import struct
 
-from port import DEFAULT_PORT
+from port import DEFAULT_PORT, DEFAULT_BAUDRATE
+
+CRC = 0x40  # Command bit selecting crc16 instead of 8 bit checksum
+TAG = 0x20  # Command bit making the first payload byte a tag
+TYPE = 0x03  # Low command bits giving the type of frame
+REQUEST = 0x01
+REPLY = 0x02
+ERROR = 0x03
+NACK_CHECKSUM = 0x01
+
+
+def crc16(data):
+    # CRC-16/MODBUS, as calculated by crc16.c on the units
+    crc = 0xFFFF
+    for d in data:
+        crc ^= d
+        for i in range(8):
+            if crc & 1:
+                crc = (crc >> 1) ^ 0xA001
+            else:
+                crc >>= 1
+    return crc
+
+
+def crc8(data):
+    # CRC-8/MAXIM, as calculated by crc8.c on the units
+    crc = 0
+    for d in data:
+        crc ^= d
+        for i in range(8):
+            if crc & 1:
+                crc = (crc >> 1) ^ 0x8C
+            else:
+                crc >>= 1
+    return crc
+
+
+def decode_dht(d):
+    # Humidity in % and temperature from the 4 data bytes of a DHT11 or
+    # DHT22, told apart as dht_decode() in dht11.c does.
+    if d[0] <= 3:
+        hum = ((d[0] << 8) | d[1]) / 10
+        temp = (((d[2] & 0x7F) << 8) | d[3]) / 10
+        return hum, -temp if d[2] & 0x80 else temp
+    temp = d[2] + (d[3] & 0x7F) / 10
+    return d[0] + d[1] / 10, -temp if d[3] & 0x80 else temp
+
 
 class Bull:
-    def __init__(self, port):
-        self.serial = Serial(port, baudrate=19200)
+    def __init__(self, port, baudrate=DEFAULT_BAUDRATE, crc=False,
+                 nine_bit=False):
+        # The 9th bit of 9 bit mode is sent as parity, see send()
+        self.nine_bit = nine_bit
+        self.serial = Serial(port, baudrate=baudrate,
+                             parity=PARITY_SPACE if nine_bit else PARITY_NONE)
         self.serial.timeout = 2
         self.verbose = 0
+        self.crc = crc  # Use crc mode for requests
+        self.retries = 3  # Immediate retries when a unit nacks a request
+        self.tags = False  # Tag requests
+        self.next_tag = 0
+        self.pending = {}  # Replies received for tags not asked for yet
 
     def __del__(self):
         self.serial.close()
@@ -29,6 +84,41 @@ class Bull:
             sum += d
         return sum % 0x100
 
+    def is_crc(self, command):
+        return bool(command & CRC) and command != 0xFF
+
+    def is_error(self, command):
+        return command == 0xFF or command & TYPE == ERROR
+
+    def new_tag(self):
+        tag = self.next_tag
+        self.next_tag = (self.next_tag + 1) % 0x100
+        return tag
+
+    def frame(self, address, command, parameter, data, tag=None):
+        if self.crc:
+            command |= CRC
+        if tag is not None:
+            command |= TAG
+            data = bytes([tag]) + data
+        msg = bytes([address, command, parameter, len(data)]) + data
+        if self.crc:
+            return msg + struct.pack('<H', crc16(msg))
+        return msg + bytes([self.checksum(msg)])
+
+    def send(self, msg):
+        # Send a frame. In 9 bit mode the address byte goes out with mark
+        # parity, which the units see as the 9th bit set, and the rest with
+        # space parity. Replies have it cleared, so we receive with space.
+        if not self.nine_bit:
+            self.serial.write(msg)
+            return
+        self.serial.parity = PARITY_MARK
+        self.serial.write(msg[:1])
+        self.serial.flush()
+        self.serial.parity = PARITY_SPACE
+        self.serial.write(msg[1:])
+
     def escape(self, data):
         if not data:
             return '<empty>'
@@ -55,21 +145,39 @@ class Bull:
 
         self.print('Unit 0x%X: ' % address, end='')
 
-        if length > 0:
-            response += self.serial.read(length)
-        data = response[4:-1]
-        checksum = response[-1]
+        crc = self.is_crc(command)
+        if length + crc > 0:
+            response += self.serial.read(length + crc)
         ok = True
 
-        if self.checksum(response[:-1]) != checksum:
-            self.print('Bad checksum')
-            ok = False
+        if crc:
+            data = response[4:-2]
+            checksum = struct.unpack('<H', response[-2:])[0]
+            if crc16(response[:-2]) != checksum:
+                self.print('Bad crc')
+                ok = False
+        else:
+            data = response[4:-1]
+            checksum = response[-1]
+            if self.checksum(response[:-1]) != checksum:
+                self.print('Bad checksum')
+                ok = False
 
-        if length + 5 != len(response):
+        if length + 5 + crc != len(response):
             self.print('Bad length of response')
             ok = False
 
-        if command == 0xFF:
+        tag = None
+        if command != 0xFF and command & TAG and data:
+            tag = data[0]
+            data = data[1:]
+
+        nack = None
+        if self.is_error(command) and parameter == 0 and len(data) == 1:
+            nack = data[0]
+            self.print('Nack:', nack)
+            ok = False
+        elif self.is_error(command):
             self.print('Error response:', self.escape(data))
             ok = False
         else:
@@ -83,27 +191,154 @@ class Bull:
                     'data': data,
                     'checksum': checksum,
                     'ok': ok,
+                    'nack': nack,
+                    'tag': tag,
                     'raw': response,
             }
 
         return data
 
-    def read(self, address, parameter, data=b'', full_data=False):
-        msg = bytes([address, 0x01, parameter, len(data)])
-        msg += data;
-        msg += bytes([self.checksum(msg)]);
+    def request(self, msg, full_data=False, tag=None):
+        # Send a request. If the unit nacks it because it was corrupted on
+        # the way, send it again at once instead of waiting for a timeout.
+        for attempt in range(self.retries + 1):
+            self.send(msg)
+            if tag is None:
+                response = self.serialRead(True)
+            else:
+                response = self.receive_tag(tag)
+            if response.get('nack') != NACK_CHECKSUM:
+                break
+            self.print('Retrying')
+        if full_data:
+            return response
+        if 'data' in response:
+            return response['data']
 
-        self.serial.write(msg);
-        return self.serialRead(full_data)
+    def receive_tag(self, tag):
+        # Read replies until the one with the tag arrives. Others are kept
+        # for later.
+        if tag in self.pending:
+            return self.pending.pop(tag)
+        while True:
+            response = self.serialRead(True)
+            if not response.get('raw'):
+                return response  # Timeout
+            if response.get('tag') == tag or response.get('tag') is None:
+                return response
+            self.pending[response['tag']] = response
+
+    def read(self, address, parameter, data=b'', full_data=False):
+        tag = self.new_tag() if self.tags else None
+        msg = self.frame(address, 0x01, parameter, data or b'', tag)
+        return self.request(msg, full_data, tag)
 
     def write(self, address, parameter, value, full_data=False):
         if not isinstance(value, bytes):
             value = bytes([value])
-        msg = bytes([address, 0x81, parameter, len(value)]) + value
-        msg += bytes([self.checksum(msg)])
+        tag = self.new_tag() if self.tags else None
+        msg = self.frame(address, 0x81, parameter, value, tag)
+        return self.request(msg, full_data, tag)
+
+    def pipeline(self, requests, gap=0.05):
+        # Send requests (address, command, parameter, payload) without
+        # waiting out slow units. Each request is sent as soon as the
+        # previous reply arrived, or after gap seconds. Late replies are
+        # matched by their tag. Returns the replies (full data) in order.
+        org_timeout = self.serial.timeout
+        tags = []
+        for address, command, parameter, payload in requests:
+            tag = self.new_tag()
+            tags.append(tag)
+            self.send(self.frame(address, command, parameter, payload, tag))
+            self.serial.timeout = gap
+            response = self.receive_tag(tag)
+            if response.get('raw'):
+                self.pending[tag] = response
+        self.serial.timeout = org_timeout
+        replies = []
+        for tag in tags:
+            replies.append(self.receive_tag(tag))
+        return replies
+
+    def read_batch(self, address, reads):
+        # Perform several reads in one request. reads is a list of parameters
+        # or (parameter, payload) tuples. Returns a list of
+        # (parameter, status, data) with status 0 for ok.
+        payload = b''
+        for read in reads:
+            if isinstance(read, int):
+                read = (read, b'')
+            param, data = read
+            payload += bytes([param, len(data)]) + data
+        tag = self.new_tag() if self.tags else None
+        msg = self.frame(address, 0x11, 0x00, payload, tag)
+        d = self.request(msg, tag=tag)
+        if d is None:
+            return None
+        return self.parse_batch(d)
+
+    def parse_batch(self, d):
+        results = []
+        while len(d) >= 3:
+            param, status, length = d[0], d[1], d[2]
+            results.append((param, status, d[3:3+length]))
+            d = d[3+length:]
+        return results
+
+    def start_cycle(self, slot_ms):
+        # Broadcast a tdma cycle start. Units configured with parameter 0x26
+        # report in their slot. Collect them with receive_reports().
+        msg = self.frame(0xFF, 0x81, 0x27, bytes([slot_ms]))
+        self.send(msg)
+
+    def receive_reports(self, duration):
+        # Passively receive unasked batch replies for duration seconds.
+        # Yields (address, results) as parsed by parse_batch().
+        org_timeout = self.serial.timeout
+        self.serial.timeout = min(duration, 0.1)
+        end = time.time() + duration
+        while time.time() < end:
+            response = self.serialRead(True)
+            if not response.get('raw'):
+                continue
+            if not response['ok']:
+                # Garbage. Drop what is left of it to get back in sync.
+                self.serial.reset_input_buffer()
+                continue
+            if response['command'] & ~(CRC | TAG) == 0x12:
+                yield response['address'], self.parse_batch(response['data'])
+        self.serial.timeout = org_timeout
+
+    def set_baudrate(self, baudrate, address=0xFF):
+        # Switch unit(s) to a new baudrate, and follow. Units reply on the old
+        # rate before switching. Broadcast switches the whole bus without any
+        # replies. Units fall back to the default rate after 10 s without
+        # valid traffic, so poll them now and then.
+        data = struct.pack('I', baudrate)
+        if address == 0xFF:
+            org_timeout = self.serial.timeout
+            self.serial.timeout = 0.1
+            self.write(address, 0x0C, data)
+            self.serial.timeout = org_timeout
+        else:
+            self.write(address, 0x0C, data)
+        self.serial.flush()
+        self.serial.baudrate = baudrate
 
-        self.serial.write(msg)
-        return self.serialRead(full_data)
+    def set_nine_bit(self, nine_bit, address=0xFF):
+        # Switch unit(s) to 9 bit mode (MPCM) or back to 8N1, and follow.
+        # Works like set_baudrate(), including the fallback.
+        if address == 0xFF:
+            org_timeout = self.serial.timeout
+            self.serial.timeout = 0.1
+            self.write(address, 0x0D, int(nine_bit))
+            self.serial.timeout = org_timeout
+        else:
+            self.write(address, 0x0D, int(nine_bit))
+        self.serial.flush()
+        self.nine_bit = nine_bit
+        self.serial.parity = PARITY_SPACE if nine_bit else PARITY_NONE
 
     def read_time(self, address):
         org_verbose = self.verbose
@@ -131,19 +366,308 @@ class Bull:
             payload = b'\x01'
         else:
             payload = None
+        # Returns temperature, device id and age in seconds of the value.
+        # Age is None if the sensor has never been read.
         d = self.read(address, 0x22, payload)
-        temp = d[0] + d[1]*0x100
-        temp /= 16;
-        deviceid = hexlify(d[2:][::-1]).decode()
-        return temp, deviceid;
+        temp = struct.unpack('<h', d[0:2])[0] / 16
+        deviceid = hexlify(d[2:10][::-1]).decode()
+        age = struct.unpack('<H', d[10:12])[0] if len(d) >= 12 else 0
+        return temp, deviceid, None if age == 0xFFFF else age
+
+    def enumerate_sensors(self, address):
+        # Let the unit search its whole 1-wire bus and store the rom ids.
+        # Returns the number found.
+        d = self.write(address, 0x29, b'')
+        return d[0] if d else None
+
+    def read_sensors(self, address):
+        # Returns the rom ids known by the unit, with their latest
+        # temperature and its age in seconds (None if never read).
+        ids = self.read(address, 0x29)
+        values = self.read(address, 0x2A)
+        if ids is None or values is None:
+            return None
+        sensors = []
+        for i in range(min(len(ids) // 8, len(values) // 4)):
+            deviceid = hexlify(ids[8*i:8*i+8][::-1]).decode()
+            temp, age = struct.unpack('<hH', values[4*i:4*i+4])
+            sensors.append((deviceid, temp / 16,
+                            None if age == 0xFFFF else age))
+        return sensors
+
+    def set_resolution(self, address, bits, copy=False, sensor=None):
+        # Set DS18B20 resolution (9-12 bits) of one sensor (id as bytes), or
+        # all known by the unit. copy also stores it in the sensors' eeprom.
+        # Returns the number of sensors set.
+        payload = bytes([bits | (0x80 if copy else 0)]) + (sensor or b'')
+        d = self.write(address, 0x2B, payload)
+        return d[0] if d else None
+
+    def set_alarm(self, address, high, low, copy=False, sensor=None):
+        # Set DS18B20 alarm limits in whole degrees of one sensor (id as
+        # bytes), or all known by the unit. Returns the number of sensors set.
+        payload = struct.pack('<bbB', high, low, 1 if copy else 0)
+        d = self.write(address, 0x2C, payload + (sensor or b''))
+        return d[0] if d else None
+
+    def read_alarms(self, address, wait=1.0):
+        # Returns (temperature, device id) of the sensors outside their
+        # alarm limits. The first read starts a search, and the second,
+        # after wait seconds, gets its result.
+        d = self.read(address, 0x2D)
+        if d is not None and wait:
+            time.sleep(wait)
+            d = self.read(address, 0x2D)
+        if d is None or len(d) < 2:
+            return None
+        if struct.unpack('<H', d[:2])[0] == 0xFFFF:
+            return None  # No search done yet
+        d = d[2:]
+        alarms = []
+        for i in range(len(d) // 12):
+            temp = struct.unpack('<h', d[12*i:12*i+2])[0] / 16
+            deviceid = hexlify(d[12*i+2:12*i+10][::-1]).decode()
+            alarms.append((temp, deviceid))
+        return alarms
+
+    def read_sensor_errors(self, address, clear=False):
+        # Returns the failed reads per sensor, in the order of
+        # read_sensors(). clear sets them to 0 after reading.
+        d = self.read(address, 0x2E)
+        if clear:
+            self.write(address, 0x2E, b'')
+        return list(d) if d is not None else None
+
+    def set_leds(self, address, colors, first=None):
+        # Set leds from a list of (r, g, b), from led first or 0.
+        payload = bytes([first]) if first is not None else b''
+        for color in colors:
+            payload += bytes(color)
+        self.write(address, 0x07, payload)
+
+    XFER_CHUNK = 64
+    XFER_WINDOW = 32
+    XFER_FLASH = 0
+    XFER_LEDS = 1
+    XFER_LOG = 2
+    XFER_SERIES = 3
+
+    def new_transfer_id(self):
+        self.transfer_id = (getattr(self, 'transfer_id', 0) + 1) & 0xFF
+        return self.transfer_id
+
+    def read_chunks(self, address, tid, obj, offset, count):
+        # Ask for count chunks from offset. Returns {offset: data} of the
+        # chunks that arrived.
+        chunks = {}
+        msg = self.frame(address, 0x01, 0x30,
+                         struct.pack('<BBIB', tid, obj, offset, count))
+        self.send(msg)
+        for i in range(count):
+            response = self.serialRead(True)
+            if not response.get('raw'):
+                break  # Timeout. The rest are lost.
+            d = response.get('data')
+            if not response['ok'] or d is None or len(d) < 5 or d[0] != tid:
+                continue
+            chunk_offset = struct.unpack('<I', d[1:5])[0]
+            chunks[chunk_offset] = d[5:]
+            if len(d) - 5 < self.XFER_CHUNK:
+                break  # The end
+        return chunks
+
+    def read_object(self, address, obj, length=None, retries=3, start=0):
+        # Read a whole object (see xfer.h) from offset start, or length
+        # bytes of it, a window at a time. Lost chunks are asked for again.
+        tid = self.new_transfer_id()
+        data = b''
+        while length is None or len(data) < length:
+            chunks = self.read_chunks(address, tid, obj, start + len(data),
+                                      self.XFER_WINDOW)
+            for i in range(self.XFER_WINDOW):
+                offset = start + len(data)
+                for attempt in range(retries):
+                    if offset in chunks:
+                        break
+                    chunks.update(self.read_chunks(address, tid, obj,
+                                                   offset, 1))
+                if offset not in chunks:
+                    return None
+                data += chunks[offset]
+                if len(chunks[offset]) < self.XFER_CHUNK:
+                    return data[:length]  # The end
+        return data[:length]
+
+    def write_object(self, address, obj, data, retries=3):
+        # Write data to an object (see xfer.h), a window at a time. Chunks
+        # the unit did not get are sent again.
+        tid = self.new_transfer_id()
+        for base in range(0, len(data), self.XFER_WINDOW * self.XFER_CHUNK):
+            window = data[base:base + self.XFER_WINDOW * self.XFER_CHUNK]
+            missing = range(0, (len(window) + self.XFER_CHUNK - 1) //
+                            self.XFER_CHUNK)
+            for attempt in range(retries + 1):
+                for i in missing:
+                    offset = base + i * self.XFER_CHUNK
+                    chunk = data[offset:offset + self.XFER_CHUNK]
+                    self.send(self.frame(address, 0x81, 0x30,
+                                         struct.pack('<BBI', tid, obj, offset)
+                                         + chunk))
+                    # No reply. Give the unit time to take the frame.
+                    self.serial.flush()
+                    time.sleep(0.005)
+                d = self.read(address, 0x31)
+                if d is None or len(d) < 10:
+                    continue
+                status_id, error, status_base, received = \
+                    struct.unpack('<BBII', d[:10])
+                if status_id != tid or status_base != base:
+                    continue
+                if error:
+                    self.print('Transfer error:', error)
+                    return False
+                missing = [i for i in missing if not received & (1 << i)]
+                if not missing:
+                    break
+            else:
+                return False
+        return True
+
+    def read_log_info(self, address):
+        # Returns (first, next, size, period) of the flash log, see
+        # flash_log.h. size is 0 without a flash chip.
+        d = self.read(address, 0x32)
+        if d is None or len(d) < 14:
+            return None
+        return struct.unpack('<IIIH', d[:14])
+
+    def set_log_period(self, address, seconds):
+        self.write(address, 0x32, struct.pack('<H', seconds))
+
+    def read_log(self, address, since=None):
+        # Download the flash log from sequence number since, or all of it.
+        # Returns a list of (seq, time_s, channel, value), where value is the
+        # temperature and rom id prefix of a DS18B20, (humidity, temperature)
+        # of the DHT or the ADC reading. Records with a bad crc are skipped.
+        info = self.read_log_info(address)
+        if info is None or info[2] == 0:
+            return None
+        first = info[0] if since is None else max(since, info[0])
+        d = self.read_object(address, self.XFER_LOG, start=16 * first)
+        if d is None:
+            return None
+        records = []
+        for i in range(0, len(d) - 15, 16):
+            r = d[i:i+16]
+            if crc8(r[:15]) != r[15]:
+                continue
+            seq, t, channel = struct.unpack('<IIB', r[:9])
+            data = r[9:15]
+            if channel == 0x40:
+                value = decode_dht(data)
+            elif channel == 0x41:
+                value = struct.unpack('<H', data[:2])[0]
+            else:
+                value = (struct.unpack('<h', data[:2])[0] / 16,
+                         hexlify(data[2:6][::-1]).decode())
+            records.append((seq, t, channel, value))
+        return records
+
+    SERIES_TIME = 0x3F
+
+    def read_series(self, address, since=0, retries=3):
+        # Read the time series from sequence number since, see series.h.
+        # Returns (next, values), where values is a list of (seq, time_s,
+        # channel, raw value) and next is the sequence number to ask for
+        # next time. Reads again if values were recorded during the read.
+        for attempt in range(retries):
+            d = self.read_object(address, self.XFER_SERIES)
+            if d is None or len(d) < 8:
+                return None
+            seq, next_seq = struct.unpack('<II', d[:8])
+            t = 0
+            last = {}
+            values = []
+            i = 8
+            try:
+                while i < len(d):
+                    tag = d[i]
+                    kind, channel = tag >> 6, tag & 0x3F
+                    if channel == self.SERIES_TIME:
+                        if kind == 1:
+                            t += d[i + 1]
+                        else:
+                            t = struct.unpack('<I', d[i+1:i+5])[0]
+                        i += 2 if kind == 1 else 5
+                        continue
+                    if kind == 1:
+                        last[channel] += struct.unpack('<b', d[i+1:i+2])[0]
+                        i += 2
+                    elif kind == 2:
+                        last[channel] = struct.unpack('<h', d[i+1:i+3])[0]
+                        i += 3
+                    else:
+                        i += 1
+                    if seq >= since:
+                        values.append((seq, t, channel, last[channel]))
+                    seq += 1
+            except (KeyError, IndexError, struct.error):
+                continue  # Chunks from before and after a change
+            if seq == next_seq:
+                return next_seq, values
+        return None
+
+    def read_series_periods(self, address):
+        d = self.read(address, 0x34)
+        return list(d) if d is not None else None
+
+    def set_series_periods(self, address, periods):
+        # Seconds per channel, 0 for off: DS18B20 table index 0-11, DHT
+        # humidity, DHT temperature, ADC.
+        self.write(address, 0x34, bytes(periods))
+
+    ANIMATIONS = {'off': 0, 'fade': 1, 'chase': 2, 'breathe': 3, 'palette': 4}
+
+    def start_animation(self, address, effect, colors=(), period_ms=1000,
+                        leds=0, start=0):
+        # Run a led animation (see led_anim.h) from time_s start, or now.
+        # Broadcast with the same start to run units in step. colors is a
+        # list of 2-4 (r, g, b).
+        payload = bytes([self.ANIMATIONS[effect]])
+        if effect != 'off':
+            payload += struct.pack('<BHI', leds, period_ms, start)
+            for color in colors:
+                payload += bytes(color)
+        self.write(address, 0x0F, payload)
+
+    def set_brightness(self, address, brightness):
+        self.write(address, 0x0E, bytes([brightness]))
 
     def read_hum_temp(self, address):
+        # Returns humidity, temperature and the age in seconds of the values.
         d = self.read(address, 0x24)
-        # buf[0]: Humidity integral part
-        # buf[1]: Humidity decimal part
-        # buf[2]: Temperature integral part
-        # buf[3]: Temperature decimal part
-        return (d[0] + d[1]/10, d[2] + d[3]/10)
+        hum, temp = decode_dht(d)
+        age = struct.unpack('<H', d[4:6])[0] if len(d) >= 6 else 0
+        return hum, temp, age
+
+    def trigger_sample(self, address=0xFF, sensor=None):
+        # Make unit(s) sample all sensors now. Read the result with
+        # read_sample() after at least 750 ms.
+        org_timeout = self.serial.timeout
+        if address == 0xFF:
+            self.serial.timeout = 0.1  # No reply to broadcast
+        self.write(address, 0x25, sensor or b'', True)
+        self.serial.timeout = org_timeout
+
+    def read_sample(self, address):
+        d = self.read(address, 0x25)
+        t, status, temp, dht, adc = struct.unpack('<IBh4sH', d)
+        return {'time': t,
+                'busy': bool(status & 0x80),
+                'temp': temp / 16 if status & 0x01 else None,
+                'hum_temp': decode_dht(dht) if status & 0x02 else None,
+                'adc': adc if status & 0x04 else None,
+        }
 
     def read_chip_info(self, address):
         data = self.read(address, 0x0A)
@@ -160,6 +684,19 @@ if __name__ == '__main__':
     parser = ArgumentParser()
     parser.add_argument('-p', '--port', help='Serial port to use. Defaults to '
                         + DEFAULT_PORT, default=DEFAULT_PORT)
+    parser.add_argument('-b', '--baud', type=int, default=DEFAULT_BAUDRATE,
+                        help='Baudrate. Defaults to %d' % DEFAULT_BAUDRATE)
+    parser.add_argument('-c', '--crc', action='store_true', help='Use crc16 '
+                        'framing (units reply in the same mode)')
+    parser.add_argument('-t', '--tags', action='store_true', help='Tag '
+                        'requests and match replies by tag')
+    parser.add_argument('-B', '--set-baud', type=int, help='Switch the whole '
+                        'bus to this baudrate before accessing parameters')
+    parser.add_argument('-9', '--nine-bit', action='store_true', help='Use 9 '
+                        'bit framing (units in line mode 1)')
+    parser.add_argument('-M', '--set-mode', type=int, choices=[0, 1],
+                        help='Switch the whole bus to this line mode (1 is 9 '
+                        'bit) before accessing parameters')
     group = parser.add_argument_group()
     group.add_argument('-w', '--write', action='store_true', help='Write '
                        'eventhough payload is not supplied')
@@ -170,13 +707,25 @@ if __name__ == '__main__':
     parser.add_argument('-o', '--poll', action='store_true')
     parser.add_argument('-l', '--sleep', type=float, default=0, help='Sleep '
                         'between polls [ms]')
-    parser.add_argument('addresses', help='Address(es) of device(s)')
-    parser.add_argument('parameter', help='Bull parameter to access')
+    parser.add_argument('addresses', nargs='?', help='Address(es) of device(s)')
+    parser.add_argument('parameter', nargs='?', help='Bull parameter to access')
     parser.add_argument('payload', nargs='*', help='Payload as hex string. When '
                         'supplied, a write will be performed unless -r is supplied')
     args = parser.parse_args()
 
 
+    b = Bull(args.port, args.baud, args.crc, args.nine_bit)
+    b.verbose = 1
+    b.tags = args.tags
+    if args.set_baud:
+        b.set_baudrate(args.set_baud)
+    if args.set_mode is not None:
+        b.set_nine_bit(args.set_mode == 1)
+    if args.addresses is None or args.parameter is None:
+        if not args.set_baud and args.set_mode is None:
+            parser.error('addresses and parameter are required')
+        exit(0)
+
     addresses = [int(address, 0) for address in args.addresses.split()]
     param = int(args.parameter, 0)
     if args.string:
@@ -184,8 +733,6 @@ if __name__ == '__main__':
     else:
         data = b''.fromhex(''.join(args.payload))
     writing = (data and not args.read) or args.write
-    b = Bull(args.port)
-    b.verbose = 1
     while True:
         for address in addresses:
             if writing:
@@ -0,0 +1,16 @@
+#ifndef CRC16_H__
+#define CRC16_H__
+
+#include <stdint.h>
+
+// CRC-16 as used by Modbus. Sent with the low byte first.
+
+#define CRC16_INIT 0xFFFF
+
+// Add one byte to a running crc. Start with CRC16_INIT.
+uint16_t crc16_update(uint16_t crc, uint8_t byte);
+
+// Calculate the crc of a buffer.
+uint16_t crc16(const uint8_t* data, uint8_t length);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef CRC8_H__
+#define CRC8_H__
+
+#include <stdint.h>
+
+// CRC-8 as used by 1-wire devices (Dallas/Maxim). The last byte of a rom id
+// or a DS18B20 scratchpad is the crc of the bytes before it, so the crc of
+// the whole block is 0 when it is valid.
+
+#define CRC8_INIT 0x00
+
+// Add one byte to a running crc. Start with CRC8_INIT.
+uint8_t crc8_update(uint8_t crc, uint8_t byte);
+
+// Calculate the crc of a buffer.
+uint8_t crc8(const uint8_t* data, uint8_t length);
+
+#endif
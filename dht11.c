@@ -1,28 +1,37 @@
 #include "dht11.h"
 #include "hardware.h"
+#include "globals.h"
 #include <string.h>  // For memset
-#include <util/delay.h>
-
-uint8_t dht_wait(uint8_t requested_bit) {
-  uint8_t wait;
-  for (wait=100; wait > 0; wait--) {
-    if (requested_bit) {
-      if (dht_pin()) {
-        // We want a one and got a one.
-        return 0;
-      }
-    } else {
-      if (!dht_pin()) {
-        // We want a zero and got a zero.
-        return 0;
-      }
-    }
-    _delay_us(1);
-  }
+#include <avr/interrupt.h>
 
-  // Timeout.
-  return 1;
-}
+// States
+#define DHT_IDLE     0
+#define DHT_START    1 // Start pulse, line held low
+#define DHT_RESPONSE 2 // Waiting for the reply to pull the line low
+#define DHT_DATA     3 // Receiving the 80 us high of the reply, then bits
+
+#define DHT_START_MS   18 // DHT11 needs 18 ms. DHT22 is fine with it too.
+#define DHT_TIMEOUT_MS 8  // Whole reply is about 5 ms
+
+// TCNT2 counts at F_CPU/128 and restarts at OCR2A.
+#define DHT_TICKS(us) ((uint8_t)((F_CPU / 128 / 1000) * (us) / 1000))
+#define DHT_ONE DHT_TICKS(48) // High pulses longer than this are ones
+
+volatile uint8_t dhtState;
+volatile uint8_t dhtStatus;
+uint8_t dhtMs;          // ms left of start pulse or reply
+uint8_t dhtEdges;       // Rising edges since the reply. The first is the
+                        // high part of the reply.
+uint8_t dhtRise;        // TCNT2 at last rising edge
+uint8_t dhtBuf[5];      // Being received
+uint8_t dhtData[5];     // Last good read
+volatile uint8_t dhtDone; // A read finished. Set by interrupt.
+volatile uint8_t dhtFresh; // It was good.
+uint8_t dhtStarted;     // Any read started yet
+uint16_t dhtStart;      // ticks_ms() at last start
+uint16_t dhtAge;
+uint8_t dhtWait;        // Seconds until the next background read
+uint16_t dhtSecond;     // ticks_ms() when the age was last updated
 
 uint8_t dht_verify_checksum(uint8_t buf[5]) {
   /*
@@ -38,48 +47,173 @@ uint8_t dht_verify_checksum(uint8_t buf[5]) {
   return sum == buf[4];
 }
 
-uint8_t dht_read(uint8_t buf[5]) {
-  uint8_t i;
+void dht_pcint(uint8_t on) {
+  // Pin change interrupt on PC4 (PCINT12)
+  if (on) {
+    PCIFR = (1 << PCIF1);
+    PCMSK1 |= (1 << PCINT12);
+    PCICR |= (1 << PCIE1);
+  } else {
+    PCMSK1 &= ~(1 << PCINT12);
+    PCICR &= ~(1 << PCIE1);
+  }
+}
+
+void dht_finish(uint8_t status) {
+  // Called with interrupts off
+  dht_pcint(0);
+  if (status == 0 && !dht_verify_checksum(dhtBuf)) {
+    status = DHT_CHECKSUM;
+  }
+  if (status == 0) {
+    memcpy(dhtData, dhtBuf, 5);
+    dhtFresh = 1;
+  }
+  dhtState = DHT_IDLE;
+  dhtStatus = status;
+  dhtDone = 1;
+}
 
-  memset(buf, 0x0, 5);
+void dht_start() {
+  uint16_t now = ticks_ms();
 
+  if (dhtStarted && (uint16_t)(now - dhtStart) < DHT_INTERVAL_MS) {
+    return; // Too soon. The last result stands.
+  }
+  cli();
+  if (dhtState != DHT_IDLE) {
+    sei();
+    return;
+  }
+  dhtStarted = 1;
+  dhtStart = now;
+  memset(dhtBuf, 0, 5);
+  dhtEdges = 0;
+  dhtMs = DHT_START_MS;
+  dhtStatus = DHT_BUSY;
+  dhtState = DHT_START;
   dht_pin_low();
-  _delay_ms(18);
-  dht_pin_input();
+  sei();
+}
 
-  // The bus is now pulled high by pullups, and the DHT11 will reply
-  // with a zero within 20-40 µs. This zero will last for 80 µs.
-  _delay_us(40);
-  if (dht_pin() != 0) {
-    // dht11 did not respond.
-    return 1;
-  }
+uint8_t dht_status() {
+  return dhtStatus;
+}
 
-  // Wait for bus to go high again. When high, start waiting for transmission.
-  if(dht_wait(1)) {
-    return 2; // Oops. Timeout waiting for bus release
+void dht_data(uint8_t buf[5]) {
+  cli();
+  memcpy(buf, dhtData, 5);
+  sei();
+}
+
+uint16_t dht_age() {
+  return dhtAge;
+}
+
+void dht_init() {
+  dhtAge = DHT_AGE_UNKNOWN;
+  dhtSecond = ticks_ms();
+}
+
+void dht_poll() {
+  if ((uint16_t)(ticks_ms() - dhtSecond) >= 1000) {
+    dhtSecond += 1000;
+    if (dhtAge != DHT_AGE_UNKNOWN) {
+      dhtAge++;
+    }
+    if (dhtWait) {
+      dhtWait--;
+    }
   }
 
-  for (i = 0; i < 40; i++) {
-    // Wait for start of bit transmission
-    if (dht_wait(0)) {
-      return 3; // Timeout. No startbit.
+  if (dhtStatus == DHT_BUSY) {
+    return;
+  }
+  if (dhtDone) {
+    // Ours or someone else's. Either way, start over from here.
+    dhtDone = 0;
+    dhtWait = dhtStatus ? DHT_RETRY_S : DHT_PERIOD_S;
+    if (dhtFresh) {
+      dhtFresh = 0;
+      dhtAge = 0;
     }
+  }
+  if (dhtWait == 0) {
+    dht_start();
+  }
+}
 
-    // Wait for bus to go high to start measure time for 1 or 0.
-    if (dht_wait(1)) {
-      return 4;
+void dht_decode(const uint8_t buf[5], int16_t* humidity, int16_t* temperature) {
+  if (buf[0] <= 3) {
+    // DHT22. Tenths, sign bit on temperature.
+    *humidity = (buf[0] << 8) | buf[1];
+    *temperature = ((buf[2] & 0x7F) << 8) | buf[3];
+    if (buf[2] & 0x80) {
+      *temperature = -*temperature;
     }
+    return;
+  }
+  // DHT11. Integral and decimal parts, sign bit on the temperature decimal.
+  *humidity = buf[0] * 10 + buf[1];
+  *temperature = buf[2] * 10 + (buf[3] & 0x7F);
+  if (buf[3] & 0x80) {
+    *temperature = -*temperature;
+  }
+}
 
-    _delay_us(30); // Wait beyond the length of a zero and sample.
-    buf[i/8] <<= 1;
-    buf[i/8] |= dht_pin();
+void dht_tick() {
+  // The timer interrupt runs with interrupts on. Keep the pin change
+  // interrupt out while looking at the state.
+  cli();
+  if (dhtState == DHT_START) {
+    if (--dhtMs == 0) {
+      // Let go and wait for the reply
+      dhtMs = DHT_TIMEOUT_MS;
+      dhtState = DHT_RESPONSE;
+      dht_pcint(1);
+      dht_pin_input();
+    }
+  } else if (dhtState != DHT_IDLE) {
+    if (--dhtMs == 0) {
+      dht_finish(dhtState == DHT_RESPONSE ? DHT_NO_RESPONSE : DHT_TIMEOUT);
+    }
   }
+  sei();
+}
+
+ISR (PCINT1_vect) {
+  uint8_t now = TCNT2;
+  uint8_t high, bit;
 
-  if (!dht_verify_checksum(buf)) {
-    return 5;
+  if (dhtState < DHT_RESPONSE) {
+    return;
+  }
+  if (dht_pin()) {
+    // Rising. While waiting for the reply, this is just the line going up
+    // after the start pulse.
+    if (dhtState == DHT_DATA) {
+      dhtRise = now;
+      dhtEdges++;
+    }
+    return;
+  }
+  if (dhtState == DHT_RESPONSE) {
+    dhtState = DHT_DATA; // The reply
+    return;
+  }
+  if (dhtEdges < 2) {
+    return; // End of the high part of the reply
   }
 
-  return 0;
+  // End of a bit. The counter restarts every ms.
+  high = now - dhtRise;
+  if (now < dhtRise) {
+    high += OCR2A + 1;
+  }
+  bit = dhtEdges - 2;
+  dhtBuf[bit / 8] <<= 1;
+  dhtBuf[bit / 8] |= high > DHT_ONE;
+  if (bit == 39) {
+    dht_finish(0);
+  }
 }
-
@@ -3,14 +3,63 @@
 
 #include <stdint.h>
 
-// Read temperature from DHT11 / DHT22. Returns data in supplied buffer:
-// buf[0]: Humidity integral part
-// buf[1]: Humidity decimal part
-// buf[2]: Temperature integral part
-// buf[3]: Temperature decimal part
-// buf[4]: Checksum. Validated by dht_read()
+// DHT11 / DHT22 (AM2302) reader, run by interrupts.
 //
-// Returns 0 on success.
-uint8_t dht_read(uint8_t buf[5]);
+// The start pulse is timed by dht_tick() from the 1 kHz timer. The reply
+// is decoded by the pin change interrupt: the length of each high pulse,
+// measured with TCNT2, tells a 0 (26-28 us) from a 1 (70 us). Nothing
+// waits in a loop, and other interrupts only delay the time stamps by a
+// few us, well within the margin.
+//
+// dht_poll() reads the sensor in the background every DHT_PERIOD_S, and
+// again after DHT_RETRY_S if a read fails. The last good data is kept along
+// with its age, so parameter 0x24 is answered at once. Reads are never
+// started closer than DHT_INTERVAL_MS, which the sensors need to recover.
+//
+// Data in the buffers below:
+// buf[0]: Humidity integral part   (DHT22: humidity high byte)
+// buf[1]: Humidity decimal part    (DHT22: humidity low byte)
+// buf[2]: Temperature integral part (DHT22: temperature high byte)
+// buf[3]: Temperature decimal part (DHT22: temperature low byte)
+// buf[4]: Checksum. Validated before a read succeeds.
+
+// dht_status() while a read is running
+#define DHT_BUSY 0xFF
+// Errors
+#define DHT_NO_RESPONSE 1 // No reply to the start pulse
+#define DHT_TIMEOUT     2 // Reply stopped before all 40 bits
+#define DHT_CHECKSUM    5
+
+#define DHT_INTERVAL_MS 2000 // Least time between reads. DHT11 needs 1 s.
+#define DHT_PERIOD_S    10
+#define DHT_RETRY_S     2
+#define DHT_AGE_UNKNOWN 0xFFFF
+
+// Start a read, unless one is running or the last one started less than
+// DHT_INTERVAL_MS ago. Returns at once.
+void dht_start();
+
+// DHT_BUSY while the read runs, then 0 on success or an error.
+uint8_t dht_status();
+
+// Copy the data of the last successful read to buf.
+void dht_data(uint8_t buf[5]);
+
+// Seconds since the last successful read. Saturates at DHT_AGE_UNKNOWN,
+// which also means never read.
+uint16_t dht_age();
+
+// Humidity in 0.1 % and temperature in 0.1 degrees from data read. A
+// DHT22 is told from a DHT11 by the humidity high byte, which is at most 3
+// for a DHT22 (100.0 %), and at least 20 for a DHT11.
+void dht_decode(const uint8_t buf[5], int16_t* humidity, int16_t* temperature);
+
+// Called from the 1 kHz timer interrupt.
+void dht_tick();
+
+void dht_init();
+
+// Called from the main loop to run the background sampling.
+void dht_poll();
 
 #endif
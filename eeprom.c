@@ -2,33 +2,113 @@
 #include <avr/eeprom.h>
 #include <avr/interrupt.h>
 
+// Writes are queued and done one byte at a time by the EE_READY interrupt,
+// so no one has to wait the 3.4 ms each byte takes. Each address is queued
+// at most once. Reads look in the queue before the eeprom.
+
+uint16_t eeQueueAddress[EE_QUEUE];
+uint8_t eeQueueData[EE_QUEUE];
+volatile uint8_t eeQueueHead; // Oldest entry, written next
+volatile uint8_t eeQueueCount;
+
+int8_t eeQueueFind(uint16_t address) {
+  // Return index of the queued write to address, or -1. Call with
+  // interrupts disabled.
+  uint8_t i, index;
+  for (i = 0; i < eeQueueCount; i++) {
+    index = (eeQueueHead + i) % EE_QUEUE;
+    if (eeQueueAddress[index] == address) {
+      return index;
+    }
+  }
+  return -1;
+}
+
 uint8_t eeReadByte(uint8_t* address) {
   uint8_t data;
-  eeprom_busy_wait();
-  cli();
-  data = eeprom_read_byte(address);
+  int8_t index;
+  while (1) {
+    cli();
+    index = eeQueueFind((uint16_t)address);
+    if (index >= 0) {
+      data = eeQueueData[index];
+      break;
+    }
+    if (!(EECR & (1 << EEPE))) {
+      // Not writing. The interrupt cannot start a write until we sei().
+      data = eeprom_read_byte(address);
+      break;
+    }
+    sei();
+  }
   sei();
   return data;
 }
 
 void eeWriteByte(uint8_t* address, uint8_t byte) {
-  eeprom_busy_wait();
+  int8_t index;
 
-  cli();
-  eeprom_write_byte(address, byte);
+  if (eeReadByte(address) == byte) {
+    // Save the eeprom, like eeprom_update_byte() does.
+    return;
+  }
+
+  while (1) {
+    cli();
+    index = eeQueueFind((uint16_t)address);
+    if (index >= 0) {
+      // Not written yet. Just change what will be written.
+      eeQueueData[index] = byte;
+      break;
+    }
+    if (eeQueueCount < EE_QUEUE) {
+      index = (eeQueueHead + eeQueueCount) % EE_QUEUE;
+      eeQueueAddress[index] = (uint16_t)address;
+      eeQueueData[index] = byte;
+      eeQueueCount++;
+      break;
+    }
+    // Queue full. Let the interrupt make room.
+    sei();
+  }
+  EECR |= (1 << EERIE);
   sei();
 }
 
 void eeReadBlock(uint8_t* address, uint8_t *buffer, uint8_t length) {
-  eeprom_busy_wait();
-  cli();
-  eeprom_read_block(buffer, address, length);
-  sei();
+  while (length--) {
+    *buffer++ = eeReadByte(address++);
+  }
 }
 
 void eeWriteBlock(uint8_t* address, const uint8_t* buffer, uint8_t length) {
-  eeprom_busy_wait();
-  cli();
-  eeprom_update_block(buffer, address, length);
-  sei();
+  while (length--) {
+    eeWriteByte(address++, *buffer++);
+  }
+}
+
+void eeFlush() {
+  while (eeQueueCount || (EECR & (1 << EEPE))) {
+    ;
+  }
+}
+
+ISR (EE_READY_vect) {
+  // The eeprom is ready for the next byte.
+  uint8_t index = eeQueueHead;
+
+  if (eeQueueCount == 0) {
+    // Nothing more to write. This interrupt fires as long as it is enabled.
+    EECR &= ~(1 << EERIE);
+    return;
+  }
+
+  EEAR = eeQueueAddress[index];
+  EEDR = eeQueueData[index];
+  eeQueueHead = (index + 1) % EE_QUEUE;
+  eeQueueCount--;
+
+  // EEPE must be set within four cycles of EEMPE. Interrupts are off here.
+  EECR |= (1 << EEMPE);
+  EECR |= (1 << EEPE);
 }
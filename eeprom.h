@@ -10,13 +10,44 @@
 // ...  | Name of device
 // 0x0F -
 // 0x10 Bitmask of current running state. 1 == do not listen to incoming uart.
+// 0x11 -
+// ...  | Baudrate, 32 bit (uart.c)
+// 0x14 -
+// 0x15 Line mode, 0 or 1 for 9 bit (uart.c)
+// 0x16 DS18B20 sampling period (therm_table.c)
+// 0x17 Led brightness (ws2812b_led.c)
+// 0x18 -
+// 0x19 - Flash log period, 16 bit (flash_log.c)
 // 0x20 -
 // ...  | Mapped to parameters 0x10-0x1F, 1 byte per parameter (bull.c)
 // 0x2f -
+// 0x30 Tdma slot (tdma.c)
+// 0x31 Tdma list length
+// 0x32 -
+// ...  | Tdma list of reads to report
+// 0x3F -
+// 0x40 Number of DS18B20 rom ids (therm_table.c)
+// 0x41 -
+// ...  | DS18B20 rom ids, 8 bytes each, at most 12
+// 0xA0 -
+// 0xA1 -
+// ...  | 1-wire bus of each DS18B20 rom id
+// 0xAC -
+// 0xAD -
+// ...  | Time series period of each channel (series.c)
+// 0xBB -
 
+
+#define EE_QUEUE 16 // Bytes waiting to be written in the background
+
+// Reads see queued writes. Writes only wait when the queue is full, and
+// skip bytes that already hold the value.
 uint8_t eeReadByte(uint8_t* address);
 void eeWriteByte(uint8_t* address, uint8_t byte);
 void eeReadBlock(uint8_t* address, uint8_t *buffer, uint8_t length);
 void eeWriteBlock(uint8_t* address, const uint8_t* buffer,
                   uint8_t length);
+
+// Wait until all queued writes are done. Needed before a reset.
+void eeFlush();
 #endif
@@ -0,0 +1,332 @@
+#include "flash_log.h"
+#include "spi.h"
+#include "crc8.h"
+#include "eeprom.h"
+#include "globals.h"
+#include "hardware.h"
+#include "therm_table.h"
+#include "dht11.h"
+#include <string.h>
+#include <avr/interrupt.h>
+
+#define EE_FLASH_LOG_PERIOD ((uint8_t*)0x18) // 2 bytes
+
+#define ADC_CHANNEL 7
+
+// Commands common to 25-series flash
+#define FL_WRITE_ENABLE 0x06
+#define FL_PAGE_PROGRAM 0x02
+#define FL_SECTOR_ERASE 0x20
+#define FL_READ_STATUS  0x05
+#define FL_READ         0x03
+#define FL_JEDEC_ID     0x9F
+#define FL_STATUS_BUSY  0x01
+
+#define FL_PAGE_RECORDS   (256 / FLASH_LOG_RECORD)
+#define FL_SECTOR_RECORDS (4096 / FLASH_LOG_RECORD)
+
+// Capacity byte of the JEDEC id is log2 of the size in bytes. 3 byte
+// addresses reach 16 MB.
+#define FL_CAPACITY_MIN 0x10
+#define FL_CAPACITY_MAX 0x18
+
+// States
+#define FL_SCAN 0 // Chip not looked for yet
+#define FL_NONE 1 // No chip
+#define FL_IDLE 2
+#define FL_WAIT 3 // Program or erase running
+
+// Channels of a round: the DS18B20 table, the DHT and the ADC
+#define FL_CHANNELS (THERM_TABLE_LEN + 2)
+
+extern uint32_t time_s; // Defined in main.c
+
+uint8_t flState;
+uint32_t flSize;       // Records the chip holds
+uint32_t flNext;       // Sequence number of the next record
+uint8_t flErased;      // The sector of flNext is erased
+uint8_t flPending;     // Records being programmed
+uint8_t flAsked;       // Status read submitted
+uint16_t flPeriod;
+uint32_t flLast;       // time_s of the last round
+uint8_t flChannel;     // Next channel of the round, FL_CHANNELS when done
+uint8_t flCommand[4];  // Command and address
+uint8_t flStatus;
+const uint8_t flWriteEnable = FL_WRITE_ENABLE;
+struct spi_transaction flEnable; // Write enable, queued before a change
+struct spi_transaction flSpi;
+struct flash_record flBatch[FLASH_LOG_BATCH];
+
+uint32_t fl_first() {
+  // The oldest record held ends where the sector erased last ends.
+  uint32_t end = flNext - flNext % FL_SECTOR_RECORDS;
+
+  if (flErased) {
+    end += FL_SECTOR_RECORDS;
+  }
+  return end > flSize ? end - flSize : 0;
+}
+
+uint32_t fl_address(uint32_t seq) {
+  return (seq % flSize) * FLASH_LOG_RECORD;
+}
+
+void fl_submit(uint8_t command, uint32_t address, const uint8_t* tx,
+               uint8_t* rx, uint16_t len) {
+  // Queue a command, with a 3 byte address unless it is a one byte command,
+  // followed by len bytes.
+  flCommand[0] = command;
+  flCommand[1] = address >> 16;
+  flCommand[2] = address >> 8;
+  flCommand[3] = address;
+  flSpi.segments[0].tx = flCommand;
+  flSpi.segments[0].len =
+    (command == FL_READ_STATUS || command == FL_JEDEC_ID) ? 1 : 4;
+  flSpi.segments[1].tx = tx;
+  flSpi.segments[1].rx = rx;
+  flSpi.segments[1].len = len;
+  spi_submit(&flSpi);
+}
+
+void fl_read(uint32_t address, uint8_t* buf, uint16_t len) {
+  // Call with the chip idle.
+  fl_submit(FL_READ, address, 0, buf, len);
+  spi_wait(&flSpi);
+}
+
+void fl_scan() {
+  // Find the chip and the end of the log.
+  uint8_t id[3];
+  uint32_t seq, best, sectors, s;
+  uint16_t i;
+
+  flState = FL_NONE;
+  fl_submit(FL_JEDEC_ID, 0, 0, id, 3);
+  spi_wait(&flSpi);
+  if (id[0] == 0x00 || id[0] == 0xFF ||
+      id[2] < FL_CAPACITY_MIN || id[2] > FL_CAPACITY_MAX) {
+    flSize = 0;
+    return;
+  }
+  flSize = ((uint32_t)1 << id[2]) / FLASH_LOG_RECORD;
+  sectors = flSize / FL_SECTOR_RECORDS;
+
+  // The sector written last has the highest sequence number first. Others
+  // are erased, or hold garbage from before the log.
+  best = 0xFFFFFFFF;
+  for (s = 0; s < sectors; s++) {
+    fl_read(s * FL_SECTOR_RECORDS * FLASH_LOG_RECORD, (uint8_t*)&seq, 4);
+    if (seq == 0xFFFFFFFF || seq % flSize != s * FL_SECTOR_RECORDS) {
+      continue;
+    }
+    if (best == 0xFFFFFFFF || seq > best) {
+      best = seq;
+    }
+  }
+
+  if (best == 0xFFFFFFFF) {
+    flNext = 0;
+  } else {
+    // Follow the records of that sector to the end.
+    for (i = 1; i < FL_SECTOR_RECORDS; i++) {
+      fl_read(fl_address(best + i), (uint8_t*)&seq, 4);
+      if (seq != best + i) {
+        break;
+      }
+    }
+    flNext = best + i;
+  }
+  flErased = (flNext % FL_SECTOR_RECORDS) != 0;
+  flState = FL_IDLE;
+
+  // The first round after a period, when the sensors have been read.
+  cli();
+  flLast = time_s;
+  sei();
+}
+
+uint8_t fl_make(uint8_t channel, struct flash_record* record) {
+  // Fill in the data of a channel if it was read during the last period.
+  // Returns 0 if it was not.
+  uint8_t buf[5];
+  uint16_t adc;
+
+  if (channel < THERM_TABLE_LEN) {
+    if (channel >= therm_table_len ||
+        therm_values[channel].age >= flPeriod) {
+      return 0;
+    }
+    record->channel = channel;
+    memcpy(record->data, &therm_values[channel].temperature, 2);
+    memcpy(&record->data[2], &therm_ids[channel], 4);
+  } else if (channel == THERM_TABLE_LEN) {
+    if (dht_age() >= flPeriod) {
+      return 0;
+    }
+    dht_data(buf);
+    record->channel = FLASH_LOG_DHT;
+    memcpy(record->data, buf, 4);
+    record->data[4] = 0;
+    record->data[5] = 0;
+  } else {
+    adc = read_adc(ADC_CHANNEL);
+    record->channel = FLASH_LOG_ADC;
+    memset(record->data, 0, sizeof(record->data));
+    memcpy(record->data, &adc, 2);
+  }
+  return 1;
+}
+
+void fl_append() {
+  // Program as many records of the round as fit in the page of flNext.
+  uint8_t count = 0;
+  struct flash_record* record;
+
+  while (count < FLASH_LOG_BATCH && flChannel < FL_CHANNELS) {
+    if (count && (flNext + count) % FL_PAGE_RECORDS == 0) {
+      break;
+    }
+    record = &flBatch[count];
+    if (!fl_make(flChannel++, record)) {
+      continue;
+    }
+    record->seq = flNext + count;
+    record->time = flLast;
+    record->crc = crc8((uint8_t*)record, FLASH_LOG_RECORD - 1);
+    count++;
+  }
+  if (!count) {
+    return;
+  }
+  spi_submit(&flEnable);
+  fl_submit(FL_PAGE_PROGRAM, fl_address(flNext), (uint8_t*)flBatch, 0,
+            count * FLASH_LOG_RECORD);
+  flPending = count;
+  flState = FL_WAIT;
+}
+
+void flash_log_poll() {
+  uint32_t now;
+
+  if (flState == FL_SCAN) {
+    fl_scan();
+    return;
+  }
+
+  if (flState == FL_WAIT) {
+    // Ask for the status until the chip is done.
+    if (flSpi.busy) {
+      return;
+    }
+    if (!flAsked) {
+      fl_submit(FL_READ_STATUS, 0, 0, &flStatus, 1);
+      flAsked = 1;
+      return;
+    }
+    flAsked = 0;
+    if (flStatus & FL_STATUS_BUSY) {
+      return;
+    }
+    if (flPending) {
+      flNext += flPending;
+      flPending = 0;
+      if (flNext % FL_SECTOR_RECORDS == 0) {
+        flErased = 0; // Into the next sector
+      }
+    }
+    flState = FL_IDLE;
+    return;
+  }
+
+  if (flState != FL_IDLE || flPeriod == 0) {
+    return;
+  }
+
+  cli();
+  now = time_s;
+  sei();
+  if (flChannel >= FL_CHANNELS) {
+    if (now - flLast < flPeriod) {
+      return;
+    }
+    flLast = now;
+    flChannel = 0;
+  }
+
+  if (!flErased) {
+    // First record of a sector. Make room.
+    spi_submit(&flEnable);
+    fl_submit(FL_SECTOR_ERASE, fl_address(flNext), 0, 0, 0);
+    flErased = 1;
+    flState = FL_WAIT;
+    return;
+  }
+  fl_append();
+}
+
+void flash_log_info(struct flash_log_info* info) {
+  info->first = fl_first();
+  info->next = flNext;
+  info->size = flSize;
+  info->period = flPeriod;
+  if (flState == FL_SCAN || flState == FL_NONE) {
+    info->first = 0;
+    info->next = 0;
+    info->size = 0;
+  }
+}
+
+void flash_log_set_period(uint16_t seconds) {
+  flPeriod = seconds;
+  eeWriteBlock(EE_FLASH_LOG_PERIOD, (uint8_t*)&seconds, 2);
+}
+
+uint8_t flash_log_read(uint32_t offset, uint8_t* buf, uint8_t len) {
+  uint32_t begin, end, address, bytes;
+  uint8_t first;
+
+  while (flState == FL_SCAN || flState == FL_WAIT) {
+    flash_log_poll();
+  }
+  if (flState != FL_IDLE) {
+    return 0;
+  }
+
+  begin = fl_first() * FLASH_LOG_RECORD;
+  end = flNext * FLASH_LOG_RECORD;
+  if (offset < begin || offset >= end) {
+    return 0;
+  }
+  if (len > end - offset) {
+    len = end - offset;
+  }
+
+  // The log may wrap around the end of the chip within the read.
+  bytes = flSize * FLASH_LOG_RECORD;
+  address = offset % bytes;
+  first = len;
+  if (first > bytes - address) {
+    first = bytes - address;
+  }
+  fl_read(address, buf, first);
+  if (first < len) {
+    fl_read(0, buf + first, len - first);
+  }
+  return len;
+}
+
+void flash_log_init() {
+  flEnable.cs = SPI_CS_FLASH;
+  flEnable.divider = SPI_DIV_2;
+  flEnable.segments[0].tx = &flWriteEnable;
+  flEnable.segments[0].len = 1;
+  flSpi.cs = SPI_CS_FLASH;
+  flSpi.divider = SPI_DIV_2;
+
+  eeReadBlock(EE_FLASH_LOG_PERIOD, (uint8_t*)&flPeriod, 2);
+  if (flPeriod == 0xFFFF) {
+    flPeriod = FLASH_LOG_PERIOD_DEFAULT;
+  }
+  flState = FL_SCAN;
+  flChannel = FL_CHANNELS;
+}
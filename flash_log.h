@@ -0,0 +1,68 @@
+#ifndef FLASH_LOG_H__
+#define FLASH_LOG_H__
+
+#include <stdint.h>
+
+// Sample log in SPI NOR flash
+//
+// An optional 25-series flash chip (W25Q, AT25, MX25, ...) on the SPI pins,
+// with PB1 as chip select, keeps a log that survives both the host being
+// down and the unit rebooting. The chip is found by its JEDEC id; without
+// one the log is off.
+//
+// Every period, one record is appended for each value read since the last
+// round: the DS18B20 sensors in the table, the DHT and the ADC. Records are
+// FLASH_LOG_RECORD bytes, numbered by a sequence number that maps to a fixed
+// place in the flash, so the log is a ring over the whole chip. Records are
+// programmed a few at a time, never across a page, and the next 4 kB sector
+// is erased when the log gets there, dropping the oldest records. All of it
+// runs from the main loop while the SPI interrupt moves the bytes. At boot,
+// the end of the log is found from the first record of each sector.
+//
+// Parameter 0x32 reads the range of sequence numbers held, and sets the
+// period. The records are downloaded as transfer object XFER_LOG (see
+// xfer.h), where the offset of a record is its sequence number times
+// FLASH_LOG_RECORD.
+
+#define FLASH_LOG_RECORD 16
+#define FLASH_LOG_BATCH 4           // Records programmed at a time
+#define FLASH_LOG_PERIOD_DEFAULT 60 // Seconds, when eeprom is cleared
+
+// Channels. Below FLASH_LOG_DHT it is the index in the DS18B20 table.
+#define FLASH_LOG_DHT 0x40
+#define FLASH_LOG_ADC 0x41
+
+struct flash_record {
+  uint32_t seq;     // Sequence number, 0xFFFFFFFF in erased flash
+  uint32_t time;    // time_s when the round started
+  uint8_t channel;  // FLASH_LOG_* or DS18B20 table index
+  uint8_t data[6];  // DS18B20: temperature in 1/16 degrees and the first 4
+                    // bytes of the rom id. DHT: 4 bytes as read, see
+                    // dht11.h. ADC: 16 bit value.
+  uint8_t crc;      // crc8 of the bytes before
+};
+
+// Laid out as the reply of parameter 0x32.
+struct flash_log_info {
+  uint32_t first;  // Sequence number of the oldest record held
+  uint32_t next;   // Sequence number of the next record to be written
+  uint32_t size;   // Records the chip holds, 0 without a chip
+  uint16_t period; // Seconds between rounds, 0 if off
+};
+
+void flash_log_info(struct flash_log_info* info);
+
+// Set the period in seconds and store it in eeprom. 0 turns the log off.
+void flash_log_set_period(uint16_t seconds);
+
+// Read up to len bytes of the log from offset, which is sequence number
+// times FLASH_LOG_RECORD, into buf. Waits for a program or erase in
+// progress. Returns the number of bytes, 0 outside the records held.
+uint8_t flash_log_read(uint32_t offset, uint8_t* buf, uint8_t len);
+
+void flash_log_init();
+
+// Called from the main loop to run the log.
+void flash_log_poll();
+
+#endif
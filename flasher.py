@@ -5,7 +5,7 @@ from binascii import hexlify
 import time
 
 import bull
-from port import DEFAULT_PORT
+from port import DEFAULT_PORT, DEFAULT_BAUDRATE
 
 class FlashException(Exception): pass
 
@@ -56,6 +56,11 @@ class Flasher:
         self.serial.timeout = 0
         self.bull.write(self.address, 0x04, 1)
 
+        # The bootloader always runs on the default baudrate, even if the
+        # bus was switched to something faster.
+        self.serial.flush()
+        self.serial.baudrate = DEFAULT_BAUDRATE
+
         time.sleep(0.5)  # It takes a while for the bootloader to start apparently.
 
         # Get in sync
@@ -243,6 +248,9 @@ if __name__ == '__main__':
     parser = ArgumentParser()
     parser.add_argument('-p', '--port', help='Serial port to use. Defaults to '
                         + DEFAULT_PORT, default=DEFAULT_PORT)
+    parser.add_argument('-b', '--baud', type=int, default=DEFAULT_BAUDRATE,
+                        help='Baudrate of the bus. Defaults to %d' %
+                        DEFAULT_BAUDRATE)
     parser.add_argument('-v', '--validate', help='Validate flash with hex file',
                         action='store_true')
     parser.add_argument('-f', '--force', action='store_true',
@@ -255,7 +263,7 @@ if __name__ == '__main__':
                         nargs='?')
     args = parser.parse_args()
 
-    b = bull.Bull(args.port)
+    b = bull.Bull(args.port, args.baud)
 
     address = int(args.address, 0)
     f = Flasher(b, address, force=args.force)
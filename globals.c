@@ -2,5 +2,5 @@
 
 union Temp temp;
 
-// Buffer used for serial communication
-uint8_t serialbuffer[SERIALBUFSIZE];
+// Buffers used for serial communication. Filled by the uart receive interrupt.
+uint8_t serialbuffer[RX_FRAMES][SERIALBUFSIZE];
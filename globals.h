@@ -14,12 +14,14 @@ union Temp {
   uint8_t  ui8;
   int16_t  i16;
   uint16_t ui16;
+  uint32_t ui32;
 };
 
 extern union Temp temp;
 
 
 #define SERIALBUFSIZE 140  // Programming flash has a payload of 129 bytes.
+#define RX_FRAMES 2        // One frame is handled while the next is received.
 #if SPM_PAGESIZE != 128
   #error This code is written for a SPM_PAGESIZE of 128 bytes.
 #endif
@@ -27,6 +29,10 @@ extern union Temp temp;
   #error The serial buffer cannot hold a full page as data.
 #endif
 
-extern uint8_t serialbuffer[SERIALBUFSIZE];
+extern uint8_t serialbuffer[RX_FRAMES][SERIALBUFSIZE];
+
+// Free running ms counter from the timer interrupt in main.c. Wraps every
+// 65 s, so compare times by subtraction.
+uint16_t ticks_ms();
 
 #endif
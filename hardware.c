@@ -1,19 +1,25 @@
 #include "hardware.h"
+#include "eeprom.h"
 
 #include <util/delay.h>
 #include <avr/interrupt.h>
 
 // Used pins:
 //
-// PB2 /SS for SPI. Must not be low during SPI operations.
+// PB1 Chip select of the log flash (see flash_log.h)
+// PB2 /SS for SPI, chip select of parameter 0x0B. Kept an output, so it
+//     does not make us a slave when low.
 // PB3 MOSI
 // PB4 MISO
 // PB5 onboard LED (or SCK for SPI)
 //
-// PC0 onewire (see thermds18b20.h)
+// PC0 onewire bus 0 (see therm_ds18b20.h)
 // PC1 Grounding button and source for random bit using ADC.
+// PC2 onewire bus 1
+// PC3 onewire bus 2
 // PC4 DHT22
 // PC5 WS1812b led chain
+// ADC7 analog input, sampled by sample.c
 //
 // PD2 RS485 direction pin
 // PD4 Debug pin
@@ -22,11 +28,14 @@
 
 void initPorts() {
   DDRB  = 0;
+  DDRB |= (1 << 1);  // Pin 1 output = log flash chip select
   DDRB |= (1 << 2);  // Pin 2 output = SPI /Slave Seleect
   DDRB |= (1 << 3);  // Pin 3 output = MOSI
   DDRB |= (1 << 5);  // Pin 5 output = LED, SPI SCK
   PORTB = 0;         // No pullup, output 0
+  PORTB |= (1 << 1); // Pin 1, output high
   PORTB |= (1 << 2); // Pin 2, output high
+  PORTB |= (1 << 4); // Pin 4 pullup = MISO. Reads 0xFF without a chip.
 
   DDRC = (1 << 5);   // Pin 5 output = WS1812b led chain
   PORTC = (1 << 1);  // Pin 1 pullup = button / random ADC.
@@ -116,10 +125,14 @@ void rs485_direction_in(){
 }
 
 uint16_t read_adc1() {
+  return read_adc(1);
+}
+
+uint16_t read_adc(uint8_t channel) {
   // ADC multiplexer selection register
   ADMUX =
     (1 << REFS0) | // REFS = 1 => AVcc as voltage reference
-    (1 << 0);      // MUX = 1  => ADC1
+    (channel & 0x0F); // MUX = channel
 
   // ADC control and status register a
   ADCSRA =
@@ -152,6 +165,9 @@ void programming_mode() {
   //     UART and Timer 1 are set to their reset state
   //     SP points to RAMEND
 
+  // Let queued eeprom writes finish. They need the interrupt.
+  eeFlush();
+
    // Disable interrupts
   cli();
 
@@ -164,6 +180,10 @@ void programming_mode() {
 
   clearTimers();
 
+  // Clear pin change interrupts (DHT)
+  PCICR = 0;
+  PCMSK1 = 0;
+
   // Move stackpointer to end of RAM
   SP = RAMEND;
 
@@ -173,15 +193,21 @@ void programming_mode() {
   do_reboot();
 }
 
-void spi_enable() {
-  // CPOL = 0, Clock low when inactive
-  // CPHA = 0, Sample on leading edge (= rising)
+void spi_enable(uint8_t mode, uint8_t divider) {
   // DORD = 0, Data order = 0, MSB first
+  // Mode bit 1 is CPOL, clock high when inactive, and bit 0 CPHA, sample on
+  // trailing edge.
   SPCR =
     (1 << SPIE) | // SPI Interrupt Enable
     (1 << SPE) |  // SPI Enable
-    (1 << SPR0) | // Rate: 0=f/4, 1=f/16, 2=f/64, 3=f/128
-    (1 << MSTR); // SPI Master
+    (1 << MSTR) | // SPI Master
+    ((mode & 3) << CPHA) |
+    (divider & 3); // Rate: 0=f/4, 1=f/16, 2=f/64, 3=f/128
+  if (divider & 4) {
+    SPSR |= (1 << SPI2X); // Double rate
+  } else {
+    SPSR &= ~(1 << SPI2X);
+  }
 }
 
 void spi_disable() {
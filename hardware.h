@@ -17,12 +17,13 @@ void rs485_direction_in();
 
 // Reading of adc (busy wait)
 uint16_t read_adc1();
+uint16_t read_adc(uint8_t channel);
 
 // Leave application code, and start executing optiboot
 void programming_mode();
 
-// SPI functions
-void spi_enable();
+// SPI functions. mode and divider as in spi.h.
+void spi_enable(uint8_t mode, uint8_t divider);
 void spi_disable();
 
 // DHT11 functions
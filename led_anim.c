@@ -0,0 +1,157 @@
+#include "led_anim.h"
+#include "ws2812b_led.h"
+#include <string.h>
+#include <avr/interrupt.h>
+
+extern uint32_t time_s;  // Defined in main.c
+extern uint16_t time_ms;
+
+// States
+#define ANIM_STOPPED 0
+#define ANIM_WAITING 1 // For the start time
+#define ANIM_RUNNING 2
+
+struct anim_scene anim_scene;
+uint8_t anim_scene_len;
+
+volatile uint8_t animState;
+uint16_t animPhase;           // ms into the period
+uint8_t animCycles;           // Whole periods done, saturating
+uint8_t animFrame;            // ms until the next frame
+volatile uint8_t animRender;  // Time to render a frame
+
+uint8_t anim_start(const uint8_t* scene, uint8_t len) {
+  const struct anim_scene* s = (const struct anim_scene*)scene;
+
+  if (len == 0) {
+    return 1;
+  }
+  if (s->effect == ANIM_OFF) {
+    anim_stop();
+    return 0;
+  }
+  if (s->effect > ANIM_PALETTE || s->period_ms == 0 ||
+      len < ANIM_SCENE_MIN || len > sizeof(struct anim_scene) ||
+      (len - ANIM_SCENE_MIN) % 3 != 0) {
+    return 1;
+  }
+
+  // The tick does not look at the scene while stopped.
+  animState = ANIM_STOPPED;
+  memcpy(&anim_scene, scene, len);
+  anim_scene_len = len;
+  animState = ANIM_WAITING;
+  return 0;
+}
+
+void anim_stop() {
+  animState = ANIM_STOPPED;
+  anim_scene_len = 0;
+}
+
+void anim_tick() {
+  // Runs with interrupts on. anim_start() only changes the scene while
+  // this leaves it alone.
+  uint32_t elapsed;
+
+  if (animState == ANIM_WAITING) {
+    if (time_s < anim_scene.start) {
+      return;
+    }
+    // Work out where we are, in case we were told late.
+    elapsed = 0;
+    if (anim_scene.start) {
+      elapsed = (time_s - anim_scene.start) * 1000 + time_ms;
+    }
+    animPhase = elapsed % anim_scene.period_ms;
+    elapsed /= anim_scene.period_ms;
+    animCycles = elapsed > 0xFF ? 0xFF : elapsed;
+    animFrame = 0;
+    animState = ANIM_RUNNING;
+  }
+  if (animState != ANIM_RUNNING) {
+    return;
+  }
+
+  if (++animPhase >= anim_scene.period_ms) {
+    animPhase = 0;
+    if (animCycles < 0xFF) {
+      animCycles++;
+    }
+  }
+  if (animFrame == 0) {
+    animFrame = ANIM_FRAME_MS;
+    animRender = 1;
+  }
+  animFrame--;
+}
+
+void anim_blend(uint8_t* rgb, const uint8_t* a, const uint8_t* b,
+                uint8_t amount) {
+  // amount 0 is all a, 255 all b
+  uint8_t i;
+  for (i = 0; i < 3; i++) {
+    rgb[i] = a[i] + (((int16_t)b[i] - a[i]) * amount) / 255;
+  }
+}
+
+void anim_poll() {
+  uint8_t rgb[3];
+  uint8_t i, leds, amount, colors, index;
+  uint16_t phase, position;
+  uint8_t cycles;
+
+  if (!animRender) {
+    return;
+  }
+  animRender = 0;
+
+  cli();
+  phase = animPhase;
+  cycles = animCycles;
+  sei();
+  if (animState != ANIM_RUNNING) {
+    return;
+  }
+
+  leds = anim_scene.leds;
+  if (leds == 0 || leds > WSLED_COUNT) {
+    leds = WSLED_COUNT;
+  }
+  amount = ((uint32_t)phase * 256) / anim_scene.period_ms;
+
+  switch (anim_scene.effect) {
+  case ANIM_FADE:
+    anim_blend(rgb, anim_scene.colors[0], anim_scene.colors[1],
+               cycles ? 255 : amount);
+    for (i = 0; i < leds; i++) {
+      wsled_set(i, rgb, 1);
+    }
+    break;
+  case ANIM_BREATHE:
+    // Up in the first half, down in the second
+    amount = amount < 128 ? amount * 2 : (255 - amount) * 2;
+    anim_blend(rgb, anim_scene.colors[0], anim_scene.colors[1], amount);
+    for (i = 0; i < leds; i++) {
+      wsled_set(i, rgb, 1);
+    }
+    break;
+  case ANIM_CHASE:
+    index = ((uint32_t)phase * leds) / anim_scene.period_ms;
+    for (i = 0; i < leds; i++) {
+      wsled_set(i, anim_scene.colors[i == index ? 1 : 0], 1);
+    }
+    break;
+  case ANIM_PALETTE:
+    // Position along the palette, in 1/256 of a color
+    colors = (anim_scene_len - ANIM_SCENE_MIN) / 3 + 2;
+    for (i = 0; i < leds; i++) {
+      position = (uint8_t)(((uint16_t)i * 256) / leds + amount) * colors;
+      index = position >> 8;
+      anim_blend(rgb, anim_scene.colors[index],
+                 anim_scene.colors[(index + 1) % colors], position & 0xFF);
+      wsled_set(i, rgb, 1);
+    }
+    break;
+  }
+}
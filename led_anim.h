@@ -0,0 +1,55 @@
+#ifndef LED_ANIM_H__
+#define LED_ANIM_H__
+
+#include <stdint.h>
+
+// Led animations
+//
+// A scene is set with one write of parameter 0x0F and then runs on its own,
+// instead of streaming frames with parameter 0x07. Time is kept by
+// anim_tick() from the 1 kHz timer, and frames are rendered into the led
+// frame buffer by anim_poll() from the main loop.
+//
+// A scene starts when time_s reaches its start time, so units given the
+// same scene by broadcast begin together. Setting the time (parameter 0x05)
+// also restarts the second, so the units agree within a few ms. A unit
+// that gets the scene after its start time joins at the right phase.
+
+// Effects. All use the first two colors, except the palette.
+#define ANIM_OFF     0 // Stop. The leds keep their colors.
+#define ANIM_FADE    1 // From color 0 to color 1 in one period, then stay
+#define ANIM_CHASE   2 // One led of color 1 on color 0, round once a period
+#define ANIM_BREATHE 3 // Color 0 to color 1 and back, once a period
+#define ANIM_PALETTE 4 // The colors spread along the leds, rotating once a
+                       // period
+
+#define ANIM_COLORS 4
+#define ANIM_FRAME_MS 20
+
+// Laid out as the payload of parameter 0x0F.
+struct anim_scene {
+  uint8_t effect;            // ANIM_*
+  uint8_t leds;              // Leds to animate from the first, 0 for all
+  uint16_t period_ms;
+  uint32_t start;            // time_s to start at. 0 starts at once.
+  uint8_t colors[ANIM_COLORS][3]; // Red, green, blue. 2-4 given.
+};
+
+#define ANIM_SCENE_MIN (sizeof(struct anim_scene) - ANIM_COLORS * 3 + 2 * 3)
+
+extern struct anim_scene anim_scene;
+extern uint8_t anim_scene_len; // Bytes of anim_scene given, 0 if stopped
+
+// Start a scene, len bytes laid out as struct anim_scene. Returns 0 if
+// valid.
+uint8_t anim_start(const uint8_t* scene, uint8_t len);
+
+void anim_stop();
+
+// Called from the 1 kHz timer interrupt.
+void anim_tick();
+
+// Called from the main loop. Renders a frame when it is time.
+void anim_poll();
+
+#endif
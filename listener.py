@@ -0,0 +1,39 @@
+#!/usr/bin/python3
+
+from argparse import ArgumentParser
+from binascii import hexlify
+import time
+
+import bull
+from port import DEFAULT_PORT, DEFAULT_BAUDRATE
+
+if __name__ == '__main__':
+    parser = ArgumentParser('Start tdma cycles and print the reports that '
+                            'the units send in their slots.')
+    parser.add_argument('-p', '--port', help='Serial port to use. Defaults to '
+                        + DEFAULT_PORT, default=DEFAULT_PORT)
+    parser.add_argument('-b', '--baud', type=int, default=DEFAULT_BAUDRATE,
+                        help='Baudrate. Defaults to %d' % DEFAULT_BAUDRATE)
+    parser.add_argument('-s', '--slot', type=int, default=20, help='Slot '
+                        'length in ms. Defaults to 20')
+    parser.add_argument('-n', '--slots', type=int, default=32, help='Number '
+                        'of slots to listen for. Defaults to 32')
+    parser.add_argument('-o', '--poll', action='store_true', help='Keep '
+                        'running cycles')
+    parser.add_argument('-t', '--trigger', action='store_true', help='Trigger '
+                        'a sample (parameter 0x25) before each cycle')
+    args = parser.parse_args()
+
+    b = bull.Bull(args.port, args.baud)
+    while True:
+        if args.trigger:
+            b.trigger_sample()
+            time.sleep(0.75)  # DS18B20 conversion time
+        b.start_cycle(args.slot)
+        duration = (args.slots + 1) * args.slot / 1000
+        for address, results in b.receive_reports(duration):
+            for param, status, data in results:
+                print('0x%02X param 0x%02X status %d: %s' %
+                      (address, param, status, hexlify(data).decode()))
+        if not args.poll:
+            break
@@ -12,19 +12,33 @@
 #include "random.h"
 #include "globals.h"
 #include "eeprom.h"
+#include "sample.h"
+#include "tdma.h"
+#include "therm_table.h"
+#include "dht11.h"
+#include "led_anim.h"
+#include "flash_log.h"
+#include "series.h"
 
 /* This program is written for an Arduino Nano */
 
-unsigned int bufpos;
 uint16_t time_ms = 0;
 uint32_t time_s = 0;
-uint32_t countdown_timer = 0;
+uint16_t time_ticks = 0; // Free running ms counter
 
 // Strings stored in flash
 const char strHELLO[] PROGMEM = "HELLO";
 
+uint16_t ticks_ms() {
+  uint16_t ticks;
+  cli();
+  ticks = time_ticks;
+  sei();
+  return ticks;
+}
+
 void idler(void) {
-  // This function is run when uart_getc is idling
+  // This function is run while waiting for uart frames
   led(morse_getled());
   wdt_reset();
 }
@@ -32,7 +46,8 @@ void idler(void) {
 
 int main(void)
 {
-  uint8_t *c;
+  uint8_t *frame;
+  uint8_t length;
   cli();
 
   wdt_enable(WDTO_8S); // Use a _long_ watchdog timeout.
@@ -43,14 +58,17 @@ int main(void)
   morse_init();
   initTimers(); //hardware.c
   rnd_init();
+  therm_table_init();
+  dht_init();
+  wsled_init();
+  flash_log_init();
+  series_init();
   sei(); //Enable interrupts.
 
-  bufpos = 0;
-
   morse_say_P(strHELLO);
-  wsled_color(10,0,0);
-  wsled_color(0,10,0);
-  wsled_color(0,0,10);
+  wsled_set_pixel(0, 60, 0, 0);
+  wsled_set_pixel(1, 0, 60, 0);
+  wsled_set_pixel(2, 0, 0, 60);
 
   if (eeReadByte((void*)0x10) & 0x01) {
     // We should not be listening to UART traffic apparently...
@@ -58,21 +76,24 @@ int main(void)
   }
   for (;;) {
     wdt_reset();
-    c = uart_getc(500, idler);
-    if (c) {
-      serialbuffer[bufpos] = *c;
-      bufpos++;
-      if (is_bull(serialbuffer, bufpos)) {
-        handle_bull(serialbuffer, bufpos);
-        bufpos = 0;
-      } else if (bufpos >= SERIALBUFSIZE) {
-        // We are getting a larger message than we can handle.
-        // Kill the buffer.
-        bufpos = 0;
+    sample_poll();
+    therm_table_poll();
+    dht_poll();
+    anim_poll();
+    wsled_poll();
+    flash_log_poll();
+    series_poll();
+    tdma_poll();
+    // Frames are assembled by the uart receive interrupt. While we handle
+    // this one, the next is received into the other buffer.
+    frame = uart_frame(&length);
+    if (frame) {
+      if (is_bull(frame, length)) {
+        handle_bull(frame, length);
       }
+      uart_frame_done();
     } else {
-      // No more data. Clear buffer.
-      bufpos = 0;
+      idler();
     }
   }
 }
@@ -87,6 +108,7 @@ ISR(TIMER2_COMPA_vect) {
 
   PORTD ^= (1 << 4); // Debug pin
 
+  time_ticks++;
   time_ms++;
   if (time_ms >= 1000) {
     time_s++;
@@ -97,7 +119,7 @@ ISR(TIMER2_COMPA_vect) {
     morse_tick();
   }
 
-  if (countdown_timer) {
-    countdown_timer--;
-  }
+  uart_tick();
+  dht_tick();
+  anim_tick();
 }
@@ -0,0 +1,370 @@
+#include "onewire.h"
+#include "therm_ds18b20.h"
+
+#include <util/delay.h>
+#include <avr/interrupt.h>
+
+// Operations
+#define OW_IDLE   0
+#define OW_RESET  1
+#define OW_WRITE  2
+#define OW_READ   3
+#define OW_SEARCH 4
+
+// Timing in us. A time slot is 60 us plus recovery. The low pulse, release
+// and sample at the start of a slot are done with interrupts off.
+#define OW_RESET_US    480 // Reset pulse
+#define OW_PRESENCE_US 70  // Release to sampling the presence pulse
+#define OW_RESET_END_US 410 // Rest of the presence period
+#define OW_SLOT_US     60  // From start of slot to release
+#define OW_RECOVERY_US 10  // Line released between slots
+
+// Timer1 runs at F_CPU/8, 2 ticks per us at 16MHz.
+#define OW_TICKS(us) ((uint16_t)((F_CPU/8/1000000UL) * (us)))
+
+const uint8_t owPins[OW_BUSES] = THERM_BUS_PINS;
+
+volatile uint8_t owOp;    // Current operation
+uint8_t owPhase;          // Step within reset, or 1 at end of time slot
+uint8_t owResult;
+uint8_t owBuses;          // Buses taking part
+uint8_t owActive;         // Pins of those buses
+uint8_t* owData;          // Buffer of current write/read, for bus 0
+uint8_t owStride;         // Distance to the buffer of the next bus
+uint8_t owBits;           // Bits left to write/read
+uint8_t owByte;           // Byte position in each buffer
+uint8_t owBit;            // Bit position in that byte
+ow_callback_t owDone;
+
+uint64_t* owMasks;        // Search discrepancy masks
+uint64_t* owIds;          // Search results
+uint8_t owPos;            // Search position, 0-63
+uint8_t owStep;           // Search slot within position: read, read, write
+uint8_t owNormal;         // Pins of the first bit read at this position
+int8_t owTop[OW_BUSES];   // Highest set bit in each mask when we got there
+
+void ow_start(uint8_t op, uint8_t buses, ow_callback_t done) {
+  // Called with the previous operation done. Interrupts might be off if we
+  // are called from a callback.
+  uint8_t b;
+
+  owOp = op;
+  owPhase = 0;
+  owResult = 0;
+  owDone = done;
+  owBuses = buses;
+  owActive = 0;
+  for (b = 0; b < OW_BUSES; b++) {
+    if (buses & (1 << b)) {
+      owActive |= owPins[b];
+    }
+  }
+
+  // CTC mode, first step as soon as possible
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TCNT1 = 0;
+  OCR1A = OW_TICKS(1);
+  TIFR1 = (1 << OCF1A);
+  TIMSK1 |= (1 << OCIE1A);
+  TCCR1B = (1 << WGM12) | (1 << CS11);
+}
+
+uint8_t ow_busy() {
+  return owOp != OW_IDLE;
+}
+
+void ow_wait() {
+  while (owOp != OW_IDLE) {
+    ;
+  }
+}
+
+uint8_t ow_result() {
+  return owResult;
+}
+
+void ow_reset(uint8_t buses, ow_callback_t done) {
+  ow_wait();
+  ow_start(OW_RESET, buses, done);
+}
+
+void ow_transfer(uint8_t op, uint8_t buses, uint8_t* data, uint8_t stride,
+                 uint8_t bits, ow_callback_t done) {
+  ow_wait();
+  owData = data;
+  owStride = stride;
+  owBits = bits;
+  owByte = 0;
+  owBit = 0;
+  ow_start(op, buses, done);
+}
+
+void ow_write(uint8_t buses, const uint8_t* data, uint8_t stride,
+              uint8_t bits, ow_callback_t done) {
+  ow_transfer(OW_WRITE, buses, (uint8_t*)data, stride, bits, done);
+}
+
+void ow_read(uint8_t buses, uint8_t* data, uint8_t stride, uint8_t bits,
+             ow_callback_t done) {
+  ow_transfer(OW_READ, buses, data, stride, bits, done);
+}
+
+void ow_search(uint8_t buses, uint64_t* discrepancy_masks, uint64_t* ids,
+               ow_callback_t done) {
+  uint8_t b;
+
+  ow_wait();
+  owMasks = discrepancy_masks;
+  owIds = ids;
+  owPos = 0;
+  owStep = 0;
+
+  // Deciding with the top bit instead of comparing 64 bit values keeps the
+  // interrupt short.
+  for (b = 0; b < OW_BUSES; b++) {
+    if (!(buses & (1 << b))) {
+      continue;
+    }
+    ids[b] = 0;
+    owTop[b] = 63;
+    while (owTop[b] >= 0 && !((discrepancy_masks[b] >> owTop[b]) & 1)) {
+      owTop[b]--;
+    }
+  }
+  ow_start(OW_SEARCH, buses, done);
+}
+
+void ow_release() {
+  THERM_DDR &= ~owActive;
+  THERM_PORT |= owActive; // Pullup
+}
+
+uint8_t ow_slot(uint8_t ones) {
+  // Start a time slot on all active buses, writing 1 on the pins in ones and
+  // 0 on the rest. Return the line values at the sampling point. Where
+  // writing 1, that is the bit read.
+  uint8_t value;
+
+  THERM_PORT &= ~owActive;
+  THERM_DDR |= owActive;
+  _delay_us(5);
+  THERM_DDR &= ~ones;
+  THERM_PORT |= ones; // Pullup
+  _delay_us(9);
+  value = THERM_PIN;
+  return value;
+}
+
+// Search
+//
+// At each position, the devices send their bit and its complement:
+//
+//  0 1 or 1 0: All active devices had the same bit. Select it.
+//  1 1:        No device responded.
+//  0 0:        Active devices have different bits in current pos.
+//
+// For a discrepancy, check if this is the most significant bit in the
+// discrepancyMask. If so, take the other route at this position (zero
+// that is).
+// Ex:
+// 0000100101001 <- least significant
+//     ^ ^  ^  <--- If current position is here:
+//     | |  |
+//     | |  +--We have more to investigate higher up,
+//     | |     select bit = 1
+//     | +-----We have been here already and are now in the
+//     |       bit=0 branch
+//     +-------Time to take the other route (bit = 0). Reset
+//             the mask and go with bit = 0.
+//
+// If the mask is zero at the position and we have passed its most
+// significant bit, we have found a new discrepancy. Set the mask to 1
+// there and go for the 1-branch. If we have not passed it, the 1-branch
+// has been searched already, so keep going in the 0-branch.
+//
+// owTop stands in for comparing the 64 bit mask at each position.
+uint8_t ow_search_select(uint8_t bus) {
+  // Pick the branch at owPos when devices on bus differ there.
+  uint8_t* mask = (uint8_t*)&owMasks[bus];
+  uint8_t byte = owPos >> 3;
+  uint8_t bit = 1 << (owPos & 7);
+
+  if (mask[byte] & bit) {
+    if (owTop[bus] == owPos) {
+      // Done with the 1-branch here. Take the 0-branch and drop the bit.
+      mask[byte] ^= bit;
+      return 0;
+    }
+    return 1;
+  }
+  if (owTop[bus] < (int8_t)owPos) {
+    // New discrepancy. Take the 1-branch first.
+    mask[byte] |= bit;
+    owTop[bus] = owPos;
+    return 1;
+  }
+  return 0;
+}
+
+uint16_t ow_search_step() {
+  // One of the three slots at each search position. Returns us to the end
+  // of the slot, or 0 when done.
+  uint8_t value, b, pin;
+
+  if (owPos == 64 || owBuses == 0) {
+    return 0;
+  }
+  if (owStep == 0) {
+    owNormal = ow_slot(owActive);
+    owStep = 1;
+  } else if (owStep == 1) {
+    value = ow_slot(owActive); // Complement
+    // Work out the bits to write. Stored in owNormal.
+    for (b = 0; b < OW_BUSES; b++) {
+      pin = owPins[b];
+      if (!(owBuses & (1 << b))) {
+        continue;
+      }
+      if ((owNormal & pin) && (value & pin)) {
+        // No device responded. Leave this bus out from now on.
+        owResult |= 1 << b;
+        owBuses &= ~(1 << b);
+        owActive &= ~pin;
+      } else if (!(owNormal & pin) && !(value & pin)) {
+        owNormal &= ~pin;
+        if (ow_search_select(b)) {
+          owNormal |= pin;
+        }
+      }
+    }
+    owStep = 2;
+  } else {
+    ow_slot(owNormal & owActive);
+    for (b = 0; b < OW_BUSES; b++) {
+      if ((owBuses & (1 << b)) && (owNormal & owPins[b])) {
+        ((uint8_t*)&owIds[b])[owPos >> 3] |= 1 << (owPos & 7);
+      }
+    }
+    owStep = 0;
+    owPos++;
+  }
+  return OW_SLOT_US;
+}
+
+uint8_t ow_pattern() {
+  // Pins to write 1 on in this time slot
+  uint8_t b, ones = 0;
+  const uint8_t* data = owData + owByte;
+
+  if (owOp == OW_READ) {
+    return owActive;
+  }
+  for (b = 0; b < OW_BUSES; b++, data += owStride) {
+    if ((owBuses & (1 << b)) && ((*data >> owBit) & 1)) {
+      ones |= owPins[b];
+    }
+  }
+  return ones;
+}
+
+void ow_store(uint8_t value) {
+  // Store the bits read in this time slot
+  uint8_t b;
+  uint8_t* data = owData + owByte;
+
+  for (b = 0; b < OW_BUSES; b++, data += owStride) {
+    if (!(owBuses & (1 << b))) {
+      continue;
+    }
+    if (owBit == 0) {
+      *data = 0;
+    }
+    if (value & owPins[b]) {
+      *data |= 1 << owBit;
+    }
+  }
+}
+
+uint16_t ow_step() {
+  // Do the next step of the current operation. Returns us until the next
+  // step, or 0 when done.
+  uint8_t value, b;
+
+  if (owOp == OW_RESET) {
+    switch (owPhase++) {
+    case 0:
+      THERM_PORT &= ~owActive;
+      THERM_DDR |= owActive;
+      return OW_RESET_US;
+    case 1:
+      ow_release();
+      return OW_PRESENCE_US;
+    case 2:
+      value = THERM_PIN;
+      for (b = 0; b < OW_BUSES; b++) {
+        if ((owBuses & (1 << b)) && (value & owPins[b])) {
+          owResult |= 1 << b;
+        }
+      }
+      return OW_RESET_END_US;
+    default:
+      return 0;
+    }
+  }
+
+  if (owPhase) {
+    // End of a time slot. Release the lines.
+    owPhase = 0;
+    ow_release();
+    return OW_RECOVERY_US;
+  }
+
+  if (owOp == OW_SEARCH) {
+    owPhase = 1;
+    return ow_search_step();
+  }
+
+  if (owBits == 0) {
+    return 0;
+  }
+  // Work out what to write before the time critical part.
+  value = ow_slot(ow_pattern());
+  if (owOp == OW_READ) {
+    ow_store(value);
+  }
+  owBits--;
+  owBit++;
+  if (owBit == 8) {
+    owBit = 0;
+    owByte++;
+  }
+  owPhase = 1;
+  return OW_SLOT_US;
+}
+
+ISR (TIMER1_COMPA_vect) {
+  // The timer restarted at the compare match, so the next step is timed
+  // from the start of this one.
+  uint16_t us = ow_step();
+  ow_callback_t done;
+
+  if (us) {
+    OCR1A = OW_TICKS(us) - 1;
+    if (TCNT1 >= OCR1A) {
+      // We were late. Do not wait for the timer to wrap around.
+      TCNT1 = OCR1A - 1;
+    }
+    return;
+  }
+
+  // Done. Stop the timer and let the callback start something new.
+  TCCR1B = 0;
+  TIMSK1 &= ~(1 << OCIE1A);
+  ow_release();
+  done = owDone;
+  owOp = OW_IDLE;
+  if (done) {
+    done();
+  }
+}
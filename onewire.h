@@ -0,0 +1,57 @@
+#ifndef ONEWIRE_H__
+#define ONEWIRE_H__
+
+#include <stdint.h>
+#include "therm_ds18b20.h"
+
+// Background 1-wire engine on the THERM_BUS_PINS of THERM_PORT, driven by
+// Timer1 compare interrupts. Only the few us of each time slot where timing
+// is critical are spent in the interrupt. The rest of the slot, and the long
+// reset pulse, run while the cpu does other things.
+//
+// Each operation runs on a set of buses, given as a mask with bit n for bus
+// n. The buses are driven in lockstep: all get their time slot at once, and
+// are sampled with one read of THERM_PIN. Data for bus n is at
+// data + n * stride. A stride of 0 writes the same data to all buses.
+//
+// One operation runs at a time. Starting one waits for the previous one.
+// The buffers passed must be left untouched until the operation is done.
+// When done, the callback (if not NULL) is called from the interrupt, and may
+// start the next operation to chain a transaction.
+
+#define OW_BUSES THERM_BUSES
+#define OW_ALL_BUSES ((1 << OW_BUSES) - 1)
+
+// Called from interrupt when an operation is done
+typedef void (*ow_callback_t)(void);
+
+// Reset pulse. Result is the mask of buses where no one answered with a
+// presence pulse.
+void ow_reset(uint8_t buses, ow_callback_t done);
+
+// Write bits from data, least significant bit of data[0] first.
+void ow_write(uint8_t buses, const uint8_t* data, uint8_t stride,
+              uint8_t bits, ow_callback_t done);
+
+// Read bits into data, least significant bit of data[0] first. The stride
+// can only be 0 when reading a single bus.
+void ow_read(uint8_t buses, uint8_t* data, uint8_t stride, uint8_t bits,
+             ow_callback_t done);
+
+// Search the next rom id on each bus, after SEARCHROM has been written.
+// discrepancy_masks and ids are indexed by bus. See therm_search() for how a
+// discrepancy mask works. Result is the mask of buses where no device
+// answered.
+void ow_search(uint8_t buses, uint64_t* discrepancy_masks, uint64_t* ids,
+               ow_callback_t done);
+
+// Return true while an operation is running.
+uint8_t ow_busy();
+
+// Busy-wait for the running operation. Interrupts keep running.
+void ow_wait();
+
+// Result of the last operation.
+uint8_t ow_result();
+
+#endif
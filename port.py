@@ -1,6 +1,7 @@
 from pathlib import Path
 
 DEFAULT_PORT = '/dev/ttyUSB0'
+DEFAULT_BAUDRATE = 19200  # Also used by the bootloader
 
 defaults = Path('./defaults')
 if defaults.is_file():
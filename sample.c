@@ -0,0 +1,63 @@
+#include "sample.h"
+#include "therm_ds18b20.h"
+#include "therm_table.h"
+#include "dht11.h"
+#include "hardware.h"
+#include "globals.h"
+#include <string.h>
+#include <avr/interrupt.h>
+
+#define ADC_CHANNEL 7
+
+extern uint32_t time_s; // Defined in main.c
+
+struct sample_t sample;
+uint64_t sample_id;       // DS18B20 to read
+uint8_t sample_use_id;    // Otherwise skip rom
+uint16_t sample_started;  // ticks_ms() at trigger
+
+void sample_trigger(const uint8_t* id) {
+  cli();
+  sample.time = time_s;
+  sei();
+  sample.status = SAMPLE_BUSY;
+  sample_use_id = (id != 0);
+  if (id) {
+    memcpy(&sample_id, id, 8);
+  }
+
+  // Start the slow conversion first, and do the rest while it runs.
+  therm_convert();
+  sample_started = ticks_ms();
+
+  // The DHT is read by interrupts meanwhile, and done long before the
+  // conversion.
+  dht_start();
+
+  sample.adc = read_adc(ADC_CHANNEL);
+  sample.status |= SAMPLE_ADC;
+}
+
+void sample_poll() {
+  uint8_t buf[5];
+
+  if (!(sample.status & SAMPLE_BUSY)) {
+    return;
+  }
+  if ((uint16_t)(ticks_ms() - sample_started) < therm_table_conversion_ms() ||
+      dht_status() == DHT_BUSY) {
+    return;
+  }
+
+  if (dht_status() == 0) {
+    dht_data(buf);
+    memcpy(sample.dht, buf, 4);
+    sample.status |= SAMPLE_DHT;
+  }
+
+  if (therm_read_scratchpad(&sample.temperature,
+                            sample_use_id ? &sample_id : 0) == 0) {
+    sample.status |= SAMPLE_TEMPERATURE;
+  }
+  sample.status &= ~SAMPLE_BUSY;
+}
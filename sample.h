@@ -0,0 +1,35 @@
+#ifndef SAMPLE_H__
+#define SAMPLE_H__
+
+#include <stdint.h>
+
+// Sample
+//
+// All sensors of a unit are sampled at the same moment when triggered, and
+// the result is latched until the next trigger. The master broadcasts the
+// trigger to all units, waits for one conversion time and then reads the
+// latched values from each unit without any waiting.
+
+#define SAMPLE_TEMPERATURE 0x01 // temperature is valid
+#define SAMPLE_DHT         0x02 // dht is valid
+#define SAMPLE_ADC         0x04 // adc is valid
+#define SAMPLE_BUSY        0x80 // Sampling in progress. No temperature yet.
+
+struct sample_t {
+  uint32_t time;       // time_s when triggered
+  uint8_t  status;     // SAMPLE_*
+  int16_t  temperature; // DS18B20, 1/16 degrees
+  uint8_t  dht[4];     // Humidity and temperature, see dht11.h
+  uint16_t adc;        // ADC7
+};
+
+extern struct sample_t sample;
+
+// Start sampling. The temperature is read from the DS18B20 with the supplied
+// id, or the only one on the bus if id is 0.
+void sample_trigger(const uint8_t* id);
+
+// Called from the main loop to finish sampling.
+void sample_poll();
+
+#endif
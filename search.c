@@ -51,6 +51,10 @@ uint8_t* search_read_slot(uint8_t slot) {
   return 0;
 }
 
+uint8_t search_slot() {
+  return srch_next_slot;
+}
+
 uint8_t search_is_us(uint8_t slot) {
   return slot == srch_next_slot;
 }
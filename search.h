@@ -47,6 +47,10 @@ void search_start(uint8_t nr_slots);
 // our currently selected one.
 uint8_t* search_read_slot(uint8_t slot);
 
+// Return our selected slot for the next search. Also usable as a unique
+// number once the search is free of collisions.
+uint8_t search_slot();
+
 // Return true if the selected_slot is in fact our next selection
 uint8_t search_is_us(uint8_t slot);
 
@@ -2,7 +2,7 @@
 
 from argparse import ArgumentParser
 import bull
-from port import DEFAULT_PORT
+from port import DEFAULT_PORT, DEFAULT_BAUDRATE
 
 class ResponseGarbage(Exception): pass
 
@@ -55,6 +55,8 @@ if __name__ == '__main__':
     parser = ArgumentParser()
     parser.add_argument('-p', '--port', help='Serial port to use. Defaults to '
                         + DEFAULT_PORT, default=DEFAULT_PORT)
+    parser.add_argument('-b', '--baud', type=int, default=DEFAULT_BAUDRATE,
+                        help='Baudrate. Defaults to %d' % DEFAULT_BAUDRATE)
     parser.add_argument('-s', '--slots', type=int, default=30, help='The '
                         'number of slots to divide the search in. Default 30')
     parser.add_argument('-r', '--rounds', type=int, default=5, help='Number of '
@@ -67,7 +69,7 @@ if __name__ == '__main__':
                         'are to be silenced before search')
     args = parser.parse_args()
 
-    b = bull.Bull(args.port)
+    b = bull.Bull(args.port, args.baud)
 
     for address in args.ignored:
         address = int(address, 0)
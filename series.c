@@ -0,0 +1,248 @@
+#include "series.h"
+#include "therm_table.h"
+#include "dht11.h"
+#include "eeprom.h"
+#include "hardware.h"
+#include <string.h>
+#include <avr/interrupt.h>
+
+#define EE_SERIES_PERIODS ((uint8_t*)0xAD) // SERIES_CHANNELS bytes
+
+#define ADC_CHANNEL 7
+#define SR_ENTRY_MAX 5
+
+extern uint32_t time_s; // Defined in main.c
+
+// What a reader knows after the entries up to some point of the ring
+struct sr_state {
+  uint32_t seq;  // Of the next value
+  uint32_t time;
+  int16_t values[SERIES_CHANNELS];
+};
+
+uint8_t series_periods[SERIES_CHANNELS];
+uint8_t srBuf[SERIES_BUF];
+uint8_t srHead;           // Oldest entry
+uint8_t srLen;            // Bytes in the ring
+struct sr_state srBase;   // Before the oldest entry
+struct sr_state srEnd;    // After the newest entry
+uint32_t srSecond;        // time_s when last polled
+
+uint8_t sr_size(uint8_t tag) {
+  switch (tag >> 6) {
+  case SERIES_SAME:
+    return 1;
+  case SERIES_DELTA:
+    return 2;
+  case SERIES_VALUE:
+    return 3;
+  default:
+    return 5;
+  }
+}
+
+uint8_t sr_get(uint8_t pos, uint8_t* entry) {
+  // Copy the entry pos bytes from the oldest. Returns its size.
+  uint8_t i, size;
+
+  entry[0] = srBuf[(srHead + pos) % SERIES_BUF];
+  size = sr_size(entry[0]);
+  for (i = 1; i < size; i++) {
+    entry[i] = srBuf[(srHead + pos + i) % SERIES_BUF];
+  }
+  return size;
+}
+
+void sr_apply(struct sr_state* state, const uint8_t* entry) {
+  uint8_t kind = entry[0] >> 6;
+  uint8_t channel = entry[0] & 0x3F;
+
+  if (channel == SERIES_TIME) {
+    if (kind == SERIES_DELTA) {
+      state->time += entry[1];
+    } else if (kind == SERIES_ABS) {
+      memcpy(&state->time, &entry[1], 4);
+    }
+    return;
+  }
+  if (kind == SERIES_DELTA) {
+    state->values[channel] += (int8_t)entry[1];
+  } else if (kind == SERIES_VALUE) {
+    memcpy(&state->values[channel], &entry[1], 2);
+  }
+  state->seq++;
+}
+
+void sr_append(const uint8_t* entry) {
+  uint8_t i, size = sr_size(entry[0]);
+  uint8_t old[SR_ENTRY_MAX];
+  uint8_t oldSize;
+
+  while (SERIES_BUF - srLen < size) {
+    // Full. Drop the oldest entry into the base.
+    oldSize = sr_get(0, old);
+    sr_apply(&srBase, old);
+    srHead = (srHead + oldSize) % SERIES_BUF;
+    srLen -= oldSize;
+  }
+  for (i = 0; i < size; i++) {
+    srBuf[(srHead + srLen + i) % SERIES_BUF] = entry[i];
+  }
+  srLen += size;
+  sr_apply(&srEnd, entry);
+}
+
+void sr_record(uint8_t channel, int16_t value, uint32_t now) {
+  uint8_t entry[SR_ENTRY_MAX];
+  uint32_t seconds = now - srEnd.time;
+  int32_t delta = (int32_t)value - srEnd.values[channel];
+
+  if (seconds) {
+    if (seconds < 0x100) {
+      entry[0] = SERIES_TAG(SERIES_DELTA, SERIES_TIME);
+      entry[1] = seconds;
+    } else {
+      // Long ago, or the clock was set
+      entry[0] = SERIES_TAG(SERIES_ABS, SERIES_TIME);
+      memcpy(&entry[1], &now, 4);
+    }
+    sr_append(entry);
+  }
+
+  if (delta == 0) {
+    entry[0] = SERIES_TAG(SERIES_SAME, channel);
+  } else if (delta >= -128 && delta <= 127) {
+    entry[0] = SERIES_TAG(SERIES_DELTA, channel);
+    entry[1] = delta;
+  } else {
+    entry[0] = SERIES_TAG(SERIES_VALUE, channel);
+    memcpy(&entry[1], &value, 2);
+  }
+  sr_append(entry);
+}
+
+uint8_t sr_value(uint8_t channel, int16_t* value) {
+  // Current value of a channel. Returns 0 if there is none.
+  uint8_t buf[5];
+  int16_t humidity, temperature;
+
+  if (channel < THERM_TABLE_LEN) {
+    if (channel >= therm_table_len ||
+        therm_values[channel].age >= SERIES_STALE_S) {
+      return 0;
+    }
+    *value = therm_values[channel].temperature;
+  } else if (channel == SERIES_ADC) {
+    *value = read_adc(ADC_CHANNEL);
+  } else {
+    if (dht_age() >= SERIES_STALE_S) {
+      return 0;
+    }
+    dht_data(buf);
+    dht_decode(buf, &humidity, &temperature);
+    *value = channel == SERIES_DHT_HUMIDITY ? humidity : temperature;
+  }
+  return 1;
+}
+
+void series_poll() {
+  uint32_t now;
+  uint8_t channel, period;
+  int16_t value;
+
+  cli();
+  now = time_s;
+  sei();
+  if (now == srSecond) {
+    return;
+  }
+  srSecond = now;
+
+  for (channel = 0; channel < SERIES_CHANNELS; channel++) {
+    period = series_periods[channel];
+    if (period && now % period == 0 && sr_value(channel, &value)) {
+      sr_record(channel, value, now);
+    }
+  }
+}
+
+// Where a read is in the stream of series_read()
+struct sr_reader {
+  uint32_t offset; // Stream offset wanted
+  uint8_t* buf;
+  uint8_t len;     // Bytes wanted
+  uint16_t at;     // Stream offset of the next byte out
+};
+
+void sr_out(struct sr_reader* reader, const uint8_t* data, uint8_t size) {
+  // Put the bytes of the stream that fall into the read into its buffer.
+  while (size--) {
+    if (reader->at >= reader->offset &&
+        reader->at - reader->offset < reader->len) {
+      reader->buf[reader->at - reader->offset] = *data;
+    }
+    data++;
+    reader->at++;
+  }
+}
+
+void series_info(struct series_header* header) {
+  header->first = srBase.seq;
+  header->next = srEnd.seq;
+}
+
+uint8_t series_read(uint32_t offset, uint8_t* buf, uint8_t len) {
+  struct sr_state state = srBase;
+  struct sr_reader reader;
+  struct series_header header;
+  uint8_t entry[SR_ENTRY_MAX];
+  uint8_t pos = 0, size, channel;
+  uint16_t sent = 0; // Channels with a value in the stream
+
+  reader.offset = offset;
+  reader.buf = buf;
+  reader.len = len;
+  reader.at = 0;
+
+  series_info(&header);
+  sr_out(&reader, (const uint8_t*)&header, sizeof(header));
+  entry[0] = SERIES_TAG(SERIES_ABS, SERIES_TIME);
+  memcpy(&entry[1], &state.time, 4);
+  sr_out(&reader, entry, 5);
+
+  while (pos < srLen && reader.at < offset + len) {
+    size = sr_get(pos, entry);
+    pos += size;
+    sr_apply(&state, entry);
+    channel = entry[0] & 0x3F;
+    if (channel != SERIES_TIME && !(sent & (1 << channel))) {
+      // The reader has no value to add to yet
+      entry[0] = SERIES_TAG(SERIES_VALUE, channel);
+      memcpy(&entry[1], &state.values[channel], 2);
+      size = 3;
+      sent |= 1 << channel;
+    }
+    sr_out(&reader, entry, size);
+  }
+
+  if (reader.at <= offset) {
+    return 0;
+  }
+  return reader.at - offset < len ? reader.at - offset : len;
+}
+
+void series_set_periods(const uint8_t* periods) {
+  memcpy(series_periods, periods, SERIES_CHANNELS);
+  eeWriteBlock(EE_SERIES_PERIODS, periods, SERIES_CHANNELS);
+}
+
+void series_init() {
+  uint8_t i;
+
+  eeReadBlock(EE_SERIES_PERIODS, series_periods, SERIES_CHANNELS);
+  for (i = 0; i < SERIES_CHANNELS; i++) {
+    if (series_periods[i] == 0xFF) {
+      series_periods[i] = SERIES_PERIOD_DEFAULT;
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef SERIES_H__
+#define SERIES_H__
+
+#include <stdint.h>
+#include "therm_table.h"
+
+// Time series in RAM
+//
+// Recent values of each channel are kept in a ring buffer, so the master
+// can read a minute or more of history in one go instead of polling every
+// value. Each channel is recorded every period seconds (parameter 0x34),
+// at the seconds of time_s that are a multiple of it, from the values the
+// other modules keep up to date in the background. Values older than
+// SERIES_STALE_S are left out.
+//
+// The ring holds entries of 1 to 5 bytes. A tag byte has the kind of entry
+// in bits 7-6 and the channel in bits 5-0:
+//
+//   SERIES_SAME  Value as last time for the channel. No more bytes.
+//   SERIES_DELTA Value changed by the int8 that follows. For SERIES_TIME,
+//                seconds since the last time entry.
+//   SERIES_VALUE int16 value.
+//   SERIES_ABS   For SERIES_TIME only, the uint32 time_s.
+//
+// A time entry comes before the values recorded at that second. Values are
+// numbered by a sequence number, which time entries do not take. When the
+// ring is full, the oldest entries make room.
+//
+// The master reads it all as transfer object XFER_SERIES (see xfer.h): a
+// struct series_header, SERIES_ABS time, then the entries held, with the
+// first value of each channel as SERIES_VALUE, so it decodes on its own.
+// It leaves out the values it already has by sequence number. Offsets are
+// bytes into this stream, which moves when values are recorded, so the
+// chunks must come from a single read request. If the number of values
+// decoded does not match the header, it is read again. Multibyte values
+// are little endian. Parameter 0x33 reads just the header.
+
+#define SERIES_HOLD_S 60 // History kept at least, all channels on
+#define SERIES_STALE_S 60
+#define SERIES_PERIOD_DEFAULT 10 // When eeprom is cleared
+
+// Kinds
+#define SERIES_SAME  0
+#define SERIES_DELTA 1
+#define SERIES_VALUE 2
+#define SERIES_ABS   3
+
+// Channels. Below SERIES_DHT_HUMIDITY it is the index in the DS18B20 table,
+// in 1/16 degrees.
+#define SERIES_DHT_HUMIDITY    THERM_TABLE_LEN       // 0.1 %
+#define SERIES_DHT_TEMPERATURE (THERM_TABLE_LEN + 1) // 0.1 degrees
+#define SERIES_ADC             (THERM_TABLE_LEN + 2)
+#define SERIES_CHANNELS        (THERM_TABLE_LEN + 3)
+#define SERIES_TIME            0x3F
+
+#define SERIES_TAG(kind, channel) (((kind) << 6) | (channel))
+
+// Ring size for SERIES_HOLD_S at the default period, a round being a time
+// delta and a delta per channel. Positions in the ring are 8 bit.
+#define SERIES_BUF ((SERIES_HOLD_S / SERIES_PERIOD_DEFAULT + 1) * \
+                    (2 + 2 * SERIES_CHANNELS))
+#if SERIES_BUF > 255
+#error "SERIES_BUF too large"
+#endif
+
+// Start of XFER_SERIES, and the reply of parameter 0x33.
+struct series_header {
+  uint32_t first; // Sequence number of the first value held
+  uint32_t next;  // Sequence number the next value recorded will get
+};
+
+// Seconds between values of each channel, 0 if off. Laid out as parameter
+// 0x34.
+extern uint8_t series_periods[SERIES_CHANNELS];
+
+void series_set_periods(const uint8_t* periods);
+
+void series_info(struct series_header* header);
+
+// Read up to len bytes of the XFER_SERIES stream from offset into buf.
+// Returns the number of bytes, 0 past the end.
+uint8_t series_read(uint32_t offset, uint8_t* buf, uint8_t len);
+
+void series_init();
+
+// Called from the main loop to record values.
+void series_poll();
+
+#endif
@@ -1,75 +1,164 @@
 #include "spi.h"
-#include "globals.h"
 #include "hardware.h"
 
+#include <avr/io.h>
 #include <avr/interrupt.h>
 
-uint8_t spi_buf_tx[SPIBUFLEN-1]; // First byte sent needs no buffer
-uint8_t spi_buf_rx[SPIBUFLEN];
-uint8_t spi_bytes_in_tx_buf;
-uint8_t spi_bytes_in_rx_buf;
+struct spi_transaction* spiQueue[SPI_QUEUE];
+volatile uint8_t spiQueueHead; // Oldest entry, runs next
+volatile uint8_t spiQueueCount;
 
-uint8_t spi_busy() {
-  uint8_t busy;
-  cli();
-  busy = spi_bytes_in_tx_buf & 0x80;
-  sei();
-  return busy;
+struct spi_transaction* volatile spiCurrent;
+uint8_t spiTxSegment;  // Position of the next byte to fetch
+uint16_t spiTxPos;
+uint8_t spiRxSegment;  // Position of the next byte to receive
+uint16_t spiRxPos;
+uint16_t spiTxLeft;    // Bytes not yet written to SPDR
+uint16_t spiRxLeft;    // Bytes not yet received
+uint8_t spiTxNext;     // Fetched byte, written to SPDR next
+
+void spi_fetch() {
+  // Fetch the byte at the tx position into spiTxNext and step past it.
+  struct spi_segment* segment;
+
+  while (1) {
+    segment = &spiCurrent->segments[spiTxSegment];
+    if (spiTxPos < segment->len) {
+      break;
+    }
+    spiTxSegment++;
+    spiTxPos = 0;
+  }
+  spiTxNext = segment->tx ? segment->tx[spiTxPos] : 0xFF;
+  spiTxPos++;
 }
 
-void spi_busywait_until_done() {
-  while(spi_busy()) {
-    ;
+void spi_store(uint8_t byte) {
+  // Store a received byte at the rx position and step past it.
+  struct spi_segment* segment;
+
+  while (1) {
+    segment = &spiCurrent->segments[spiRxSegment];
+    if (spiRxPos < segment->len) {
+      break;
+    }
+    spiRxSegment++;
+    spiRxPos = 0;
   }
+  if (segment->rx) {
+    segment->rx[spiRxPos] = byte;
+  }
+  spiRxPos++;
 }
 
-void spi_send(const uint8_t *buf, uint8_t len) {
-  if (len == 0) {
-    // WTF?!?
+void spi_next() {
+  // Start the oldest queued transaction, or turn the SPI off if there is
+  // none. Call with interrupts disabled.
+  struct spi_transaction* t;
+  uint8_t i;
+  uint16_t len;
+
+  while (spiQueueCount) {
+    t = spiQueue[spiQueueHead];
+    spiQueueHead = (spiQueueHead + 1) % SPI_QUEUE;
+    spiQueueCount--;
+
+    len = 0;
+    for (i = 0; i < SPI_SEGMENTS; i++) {
+      len += t->segments[i].len;
+    }
+    if (len == 0) {
+      t->busy = 0;
+      if (t->done) {
+        t->done(t);
+      }
+      if (spiCurrent) {
+        return; // Started by the callback
+      }
+      continue;
+    }
+
+    spiCurrent = t;
+    spiTxSegment = spiRxSegment = 0;
+    spiTxPos = spiRxPos = 0;
+    spiRxLeft = len;
+    spiTxLeft = len - 1;
+    spi_fetch();
+
+    spi_enable(t->mode, t->divider);
+    PORTB |= t->cs;
+    DDRB |= t->cs;
+    PORTB &= ~t->cs;
+    SPDR = spiTxNext;
+    if (spiTxLeft) {
+      spi_fetch();
+    }
     return;
   }
-  spi_busywait_until_done();
+  spi_disable();
+}
 
-  len = len > SPIBUFLEN ? SPIBUFLEN : len; // Truncate buffer
+void spi_submit(struct spi_transaction* transaction) {
+  // Interrupts might be off if we are called from a callback. Then the
+  // queue must have room, as nothing can make room while we wait.
+  uint8_t sreg = SREG;
+  uint8_t index;
 
-  for (spi_bytes_in_tx_buf=1;
-       spi_bytes_in_tx_buf < len;
-       spi_bytes_in_tx_buf++) {
-    // Do not copy first byte. We will put that directly into sending buffer
-    // Always place last byte first in the buffer. That way, we can send
-    // buf[bytes_left-1], and when bytes_left == 0 we stop.
-    spi_buf_tx[(SPIBUFLEN-1)-len + spi_bytes_in_tx_buf] = buf[spi_bytes_in_tx_buf];
+  transaction->busy = 1;
+  while (1) {
+    cli();
+    if (spiQueueCount < SPI_QUEUE) {
+      break;
+    }
+    // Queue full. Let the interrupt make room.
+    SREG = sreg;
   }
-  spi_bytes_in_tx_buf--; // It was == len when aborting for loop
-  spi_bytes_in_tx_buf |= 0x80; // Use last bit as indicator that we are still sending.
-  spi_bytes_in_rx_buf = 0;
-
-  spi_enable();
-  SPDR = buf[0]; // Start sending.
+  index = (spiQueueHead + spiQueueCount) % SPI_QUEUE;
+  spiQueue[index] = transaction;
+  spiQueueCount++;
+  if (!spiCurrent) {
+    spi_next();
+  }
+  SREG = sreg;
 }
 
-void spi_finished() {
-  // This function should determine what to do next.
-  // The received data is in spi_buf_rx[0:spi_bytes_in_rx_buf] (python notaion)
+void spi_wait(struct spi_transaction* transaction) {
+  while (transaction->busy) {
+    ;
+  }
 }
 
+uint8_t spi_busy() {
+  return spiCurrent || spiQueueCount;
+}
 
 ISR(SPI_STC_vect) {
-  // A transmission is done
-
-  // Read input
-  spi_buf_rx[spi_bytes_in_rx_buf] = SPDR;
-  spi_bytes_in_rx_buf++;
-
-  // Check if we need to send more bytes.
-  if (spi_bytes_in_tx_buf & 0x7F) {
-    SPDR = spi_buf_tx[(SPIBUFLEN-1) - (spi_bytes_in_tx_buf & 0x7F)];
-    spi_bytes_in_tx_buf--;
-  } else {
-    // No more bytes. Determine what to do next. Since this might take a while,
-    // enable interrupts.
-    sei();
-    spi_bytes_in_tx_buf = 0; // Reset the sending bit to indicate we are done.
-    spi_finished();
+  // A byte is done. Start the next one before anything else.
+  struct spi_transaction* t;
+  uint8_t byte = SPDR;
+
+  if (spiTxLeft) {
+    SPDR = spiTxNext;
+    spiTxLeft--;
+  }
+  spi_store(byte);
+  if (--spiRxLeft) {
+    if (spiTxLeft) {
+      spi_fetch();
+    }
+    return;
+  }
+
+  // Done. Let the callback queue something new, then start the next one.
+  t = spiCurrent;
+  PORTB |= t->cs;
+  spiCurrent = 0;
+  t->busy = 0;
+  if (t->done) {
+    t->done(t);
+  }
+  if (!spiCurrent) {
+    // The callback did not start anything
+    spi_next();
   }
 }
@@ -1,22 +1,70 @@
 #ifndef SPI_H__
 #define SPI_H__
 
-// SPI communication
+#include <stdint.h>
+
+// SPI master engine
+//
+// Transactions are queued and run one after the other by the SPI interrupt.
+// Each has its own chip select pin, SPI mode and clock rate, so devices with
+// different needs can share the bus. A transaction is made of up to
+// SPI_SEGMENTS buffers sent back to back with chip select held low, like a
+// command followed by the data it reads or writes.
+//
+// The next byte to send is fetched before the interrupt, so the SPI data
+// register is written first thing in it and the bookkeeping for the byte
+// just received overlaps the next transfer.
 //
-// This module can be used for generic SPI communication.
+// The SPI is turned on while there is something to send, and off when the
+// queue runs empty, which gives PB5 back to the LED.
+//
+// A transaction and its buffers must be left untouched until it is done.
+// When done, the callback (if not NULL) is called from the interrupt, and may
+// submit the next transaction if there is room in the queue.
 
+#define SPI_QUEUE 4
+#define SPI_SEGMENTS 2
 
-#include <stdint.h>
+// Chip select pins, on PORTB, active low
+#define SPI_CS_FLASH (1 << 1) // PB1, the log flash
+#define SPI_CS_SS (1 << 2)    // /SS, the default
 
-#define SPIBUFLEN 4
-#if SPIBUFLEN > 0x7F
-#error MSB of spi_bytes_in_tx_buf is a flag indicating we are sending.
-#endif
-extern uint8_t spi_buf_rx[SPIBUFLEN];
-extern uint8_t spi_bytes_in_rx_buf;
+// Clock rate. Bits 0-1 go to SPR1:0 and bit 2 to SPI2X.
+#define SPI_DIV_4   0
+#define SPI_DIV_16  1
+#define SPI_DIV_64  2
+#define SPI_DIV_128 3
+#define SPI_DIV_2   4
+#define SPI_DIV_8   5
+#define SPI_DIV_32  6
+
+struct spi_transaction;
+
+// Called from interrupt when a transaction is done
+typedef void (*spi_callback_t)(struct spi_transaction* transaction);
+
+struct spi_segment {
+  const uint8_t* tx; // Bytes to send, or NULL to send 0xFF
+  uint8_t* rx;       // Where to put the bytes received, or NULL
+  uint16_t len;
+};
+
+struct spi_transaction {
+  uint8_t cs;      // Chip select pin mask on PORTB
+  uint8_t mode;    // SPI mode 0-3, CPOL in bit 1 and CPHA in bit 0
+  uint8_t divider; // SPI_DIV_...
+  struct spi_segment segments[SPI_SEGMENTS]; // Unused ones have len 0
+  spi_callback_t done;
+  volatile uint8_t busy; // Set from submit until done
+};
+
+// Queue a transaction. Waits for room in the queue.
+void spi_submit(struct spi_transaction* transaction);
+
+// Busy-wait for a transaction to be done. Interrupts keep running.
+void spi_wait(struct spi_transaction* transaction);
 
+// Return true while anything is queued or running.
 uint8_t spi_busy();
-void spi_busywait_until_done();
-void spi_send(const uint8_t *buf, uint8_t len);
 
 #endif
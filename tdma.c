@@ -0,0 +1,74 @@
+#include "tdma.h"
+#include "eeprom.h"
+#include "search.h"
+#include "bull.h"
+#include "globals.h"
+
+#define EE_TDMA_SLOT ((uint8_t*)0x30)
+#define EE_TDMA_LEN  ((uint8_t*)0x31)
+#define EE_TDMA_LIST ((uint8_t*)0x32)
+
+extern uint8_t address; // Defined in bull.c
+
+uint8_t tdma_active;
+uint8_t tdma_crc;
+uint16_t tdma_started; // ticks_ms() at cycle start
+uint16_t tdma_delay;   // ms from cycle start to our slot
+
+uint8_t tdma_list_len() {
+  uint8_t len = eeReadByte(EE_TDMA_LEN);
+  return len > TDMA_LIST_LEN ? 0 : len; // Cleared eeprom reads as FF.
+}
+
+uint8_t tdma_get_config(uint8_t* buf) {
+  uint8_t len = tdma_list_len();
+  buf[0] = eeReadByte(EE_TDMA_SLOT);
+  eeReadBlock(EE_TDMA_LIST, &buf[1], len);
+  return len + 1;
+}
+
+void tdma_set_config(const uint8_t* buf, uint8_t len) {
+  len = len > TDMA_LIST_LEN + 1 ? TDMA_LIST_LEN + 1 : len; // Truncate list
+  eeWriteByte(EE_TDMA_SLOT, buf[0]);
+  eeWriteByte(EE_TDMA_LEN, len - 1);
+  eeWriteBlock(EE_TDMA_LIST, &buf[1], len - 1);
+}
+
+uint8_t tdma_slot() {
+  uint8_t slot = eeReadByte(EE_TDMA_SLOT);
+  if (slot == TDMA_SLOT_ADDRESS || slot == 0xFF) {
+    return address;
+  }
+  if (slot == TDMA_SLOT_SEARCH) {
+    return search_slot();
+  }
+  return slot;
+}
+
+void tdma_cycle(uint8_t slot_ms, uint8_t crc) {
+  tdma_active = 0;
+  if (tdma_list_len() == 0) {
+    // Not configured
+    return;
+  }
+  tdma_delay = (uint16_t)tdma_slot() * slot_ms;
+  tdma_crc = crc;
+  tdma_started = ticks_ms();
+  tdma_active = 1;
+}
+
+void tdma_poll() {
+  uint8_t list[TDMA_LIST_LEN]; // Not temp, the reads use it.
+  uint8_t len;
+  if (!tdma_active) {
+    return;
+  }
+  if ((uint16_t)(ticks_ms() - tdma_started) < tdma_delay) {
+    return;
+  }
+  tdma_active = 0;
+
+  len = tdma_list_len();
+  eeReadBlock(EE_TDMA_LIST, list, len);
+  bull_report(list, len, tdma_crc);
+}
@@ -0,0 +1,35 @@
+#ifndef TDMA_H__
+#define TDMA_H__
+
+#include <stdint.h>
+
+// Tdma reporting
+//
+// Instead of polling each unit, the master broadcasts a cycle start with a
+// slot length. Each unit then waits for its own slot and sends its readings
+// unasked, as a batch read reply (command 0x11, see bull.h).
+//
+// The unit's slot is configured with parameter 0x26 together with the list
+// of reads to report, in the same (parameter, length, payload) format as a
+// batch read. Slot 0x00 or 0xFF means use the address as slot, 0xFE means
+// use the slot selected in the last search (see search.h). A unit with an
+// empty list does not take part.
+//
+// Slot n starts n * slot length ms after the cycle start. The master must
+// pick a slot length that fits the longest report.
+
+#define TDMA_SLOT_ADDRESS 0x00
+#define TDMA_SLOT_SEARCH  0xFE
+#define TDMA_LIST_LEN 14
+
+// Configuration as used by parameter 0x26: slot, list of reads.
+uint8_t tdma_get_config(uint8_t* buf);
+void tdma_set_config(const uint8_t* buf, uint8_t len);
+
+// Start a cycle. Report in our slot, using crc mode if crc is set.
+void tdma_cycle(uint8_t slot_ms, uint8_t crc);
+
+// Called from the main loop to send the report when it is our turn.
+void tdma_poll();
+
+#endif
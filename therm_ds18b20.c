@@ -1,130 +1,164 @@
 #include "therm_ds18b20.h"
+#include "onewire.h"
+#include "crc8.h"
+#include <string.h>
 
-#include <util/delay.h>	//Header for _delay_ms()
-#include <avr/interrupt.h>
+// The blocking API on top of the background engine in onewire.c. Each call
+// waits for its operation, but interrupts keep running meanwhile.
 
-#define L_ONE ((uint64_t)1)
+uint8_t therm_bus; // Bus in use
 
-uint8_t therm_reset() {
-  uint8_t i;
-
-  //Pull line low and wait for 480uS
-  THERM_OUTPUT_MODE();
-  THERM_LOW();
-  _delay_us(480);//480 //must be smaller when moving delay func to other .c file
-
-  //Release line and wait for 60uS
-  THERM_INPUT_MODE();
-  THERM_HIGH(); // Pullup
-  _delay_us(70); //60
-
-  //Store line value and wait until the completion of 480uS period
-  i=THERM_READ();
+#define BUS (1 << therm_bus)
 
-  _delay_us(410); //420
+void therm_use_bus(uint8_t bus) {
+  therm_bus = bus;
+}
 
+uint8_t therm_reset() {
   //Return the value read from the presence pulse (0=OK, 1=WRONG)
-  return i;
+  ow_reset(BUS, 0);
+  ow_wait();
+  return ow_result() ? 1 : 0;
 }
 
 void therm_write_bit(uint8_t bit) {
-  cli();
-  //Pull line low for 6uS
-  THERM_OUTPUT_MODE();
-  THERM_LOW();
-  _delay_us(6);//1
-
-  //If we want to write 1, release the line (if not will keep low)
-  if(bit) {
-    THERM_INPUT_MODE();
-    THERM_HIGH(); // Pullup
-  }
-  sei();
-
-  //Wait for 54uS and release the line (if not done before)
-  _delay_us(54);//60
-  THERM_INPUT_MODE();
-  THERM_HIGH(); // Pullup
-  _delay_us(10);
+  ow_write(BUS, &bit, 0, 1, 0);
+  ow_wait();
 }
 
 uint8_t therm_read_bit(void) {
-  uint8_t bit=0;
-  cli();
-  //Pull line low for 6uS
-  THERM_OUTPUT_MODE();
-  THERM_LOW();
-  _delay_us(5);//1
-
-  //Release line and wait for 14uS
-  THERM_INPUT_MODE();
-  THERM_HIGH(); // Pullup
-  _delay_us(9);//14
-
-  //Read line value
-  if(THERM_READ()) {
-    bit=1;
-  }
-
-  sei();
-
-  //Wait for 55uS to end and return read value
-  _delay_us(55);//45
+  uint8_t bit;
+  ow_read(BUS, &bit, 0, 1, 0);
+  ow_wait();
   return bit;
 }
 
 uint8_t therm_read_byte(void) {
-  uint8_t i=8, n=0;
-  while(i--) {
-    //Shift one position right and store read value
-    n>>=1;
-    n|=(therm_read_bit()<<7);
-  }
+  uint8_t n;
+  ow_read(BUS, &n, 0, 8, 0);
+  ow_wait();
   return n;
 }
 
 void therm_write_byte(uint8_t byte) {
-  uint8_t i=8;
-  while(i--) {
-    //Write actual bit and shift one position right to make the next bit ready
-    therm_write_bit(byte&1);
-    byte>>=1;
+  ow_write(BUS, &byte, 0, 8, 0);
+  ow_wait();
+}
+
+void therm_convert() {
+  //Reset, skip ROM and start temperature conversion on all buses
+  uint8_t command[2] = { THERM_CMD_SKIPROM, THERM_CMD_CONVERTTEMP };
+  ow_reset(OW_ALL_BUSES, 0);
+  ow_wait(); // For the result
+  ow_write(OW_ALL_BUSES & ~ow_result(), command, 0, 16, 0);
+  ow_wait();
+}
+
+uint8_t therm_select(uint64_t* id) {
+  uint8_t result = therm_reset();
+  if (id) {
+    // If id is supplied, first match the device using MATCH ROM command.
+    // The id is sent least significant bit first, as it is stored.
+    therm_write_byte(THERM_CMD_MATCHROM);
+    ow_write(BUS, (uint8_t*)id, 0, 64, 0);
+    ow_wait();
+  } else {
+    therm_write_byte(THERM_CMD_SKIPROM);
   }
+  return result;
 }
 
-void therm_read_temperature(int16_t *temp, uint64_t* id) {
-  uint8_t bit;
+uint8_t therm_scratchpad_valid(const uint8_t* scratchpad) {
+  return crc8(scratchpad, THERM_SCRATCHPAD_LEN) == 0 &&
+         (scratchpad[4] & 0x9F) == 0x1F;
+}
+
+uint8_t therm_read_config(uint64_t* id, uint8_t* scratchpad) {
+  // Read the whole scratchpad, THERM_SCRATCHPAD_LEN bytes. Returns 0 if
+  // valid.
+  uint8_t tries;
+
+  for (tries = 0; tries < THERM_RETRIES; tries++) {
+    if (therm_select(id)) {
+      return 1; // No one there. Retrying will not help.
+    }
+    therm_write_byte(THERM_CMD_RSCRATCHPAD);
+    ow_read(BUS, scratchpad, 0, 8 * THERM_SCRATCHPAD_LEN, 0);
+    ow_wait();
+    if (therm_scratchpad_valid(scratchpad)) {
+      return 0;
+    }
+  }
+  // Glitches, no device, or several.
+  therm_reset();
+  return 1;
+}
+
+uint8_t therm_read_scratchpad(int16_t *temp, uint64_t* id) {
+  uint8_t scratchpad[THERM_SCRATCHPAD_LEN];
 
-  //Reset, skip ROM and start temperature conversion
+  if (therm_read_config(id, scratchpad)) {
+    *temp = -1;
+    return 1;
+  }
+  *temp = scratchpad[0] | (scratchpad[1] << 8);
   therm_reset();
-  therm_write_byte(THERM_CMD_SKIPROM); //Have all devices to read temp.
-  therm_write_byte(THERM_CMD_CONVERTTEMP);
+  return 0;
+}
+
+uint8_t therm_read_temperature(int16_t *temp, uint64_t* id) {
+  therm_convert();
 
   //Wait until conversion is complete
   while(!therm_read_bit());
 
-  //Reset, skip ROM and send command to read Scratchpad
-  therm_reset();
-  if (id) {
-    // If id is supplied, first match the device using MATCH ROM command
-    therm_write_byte(THERM_CMD_MATCHROM);
-    for (bit = 0; bit < 64; bit++) {
-      therm_write_bit(((*id)>>bit) & 1);
+  return therm_read_scratchpad(temp, id);
+}
+
+void therm_write_config(uint64_t* id, uint8_t* scratchpad, uint8_t copy) {
+  // Write TH, TL and configuration from a scratchpad read by
+  // therm_read_config().
+  uint16_t i;
+
+  therm_select(id);
+  therm_write_byte(THERM_CMD_WSCRATCHPAD);
+  ow_write(BUS, &scratchpad[2], 0, 24, 0);
+  ow_wait();
+
+  if (copy) {
+    // The device holds the line low until the copy is done, about 10 ms.
+    therm_select(id);
+    therm_write_byte(THERM_CMD_CPYSCRATCHPAD);
+    for (i = 0; i < 1000 && !therm_read_bit(); i++) {
+      ;
     }
-    //therm_write_byte( ((*id)>>0) & 0xFF);
-    //therm_write_byte( ((*id)>>8) & 0xFF);
-    //therm_write_byte( ((*id)>>16) & 0xFF);
-    //therm_write_byte( ((*id)>>24) & 0xFF);
-  } else {
-    therm_write_byte(THERM_CMD_SKIPROM);
   }
-  therm_write_byte(THERM_CMD_RSCRATCHPAD);
-
-  //Read Scratchpad (only 2 first bytes)
-  *temp  = therm_read_byte();
-  *temp |= (therm_read_byte()<<8);
   therm_reset();
+}
 
+uint8_t therm_set_resolution(uint64_t* id, uint8_t bits, uint8_t copy) {
+  uint8_t scratchpad[THERM_SCRATCHPAD_LEN];
+
+  // The alarm limits are written along with the configuration. Read them
+  // first to keep them.
+  if (therm_read_config(id, scratchpad)) {
+    return 1;
+  }
+  scratchpad[4] = THERM_CONFIG(bits);
+  therm_write_config(id, scratchpad, copy);
+  return 0;
+}
+
+uint8_t therm_set_alarm(uint64_t* id, int8_t high, int8_t low, uint8_t copy) {
+  uint8_t scratchpad[THERM_SCRATCHPAD_LEN];
+
+  if (therm_read_config(id, scratchpad)) {
+    return 1;
+  }
+  scratchpad[2] = high;
+  scratchpad[3] = low;
+  therm_write_config(id, scratchpad, copy);
+  return 0;
 }
 
 uint64_t therm_search(uint64_t* discrepancyMask) {
@@ -141,94 +175,67 @@ uint64_t therm_search(uint64_t* discrepancyMask) {
   //
   //The function returns the first deviceID after the last found
   //and > 0xFF000000 if there is an error.
-  uint8_t position, normalBit, complementBit, selectedNextBit;
-  uint64_t deviceID = 0;
+  uint64_t masks[OW_BUSES], ids[OW_BUSES];
+  uint8_t tries;
+
+  for (tries = 0; tries < THERM_RETRIES; tries++) {
+    if(therm_reset()) {
+      // No units responding
+      return THERM_NO_DEVICES;
+    }
 
-  if(therm_reset()) {
-    // No units responding
-    return 0xFFFFFFFFFFFFFFFF;
+    // Start search
+    therm_write_byte(THERM_CMD_SEARCHROM);
+
+    // The engine walks the tree bit by bit in the background. Keep the
+    // mask until the id is known to be good, to retry the same branch.
+    masks[therm_bus] = *discrepancyMask;
+    ow_search(BUS, masks, ids, 0);
+    ow_wait();
+    if (ow_result()) {
+      //No good. No device responded.
+      *discrepancyMask = masks[therm_bus];
+      return THERM_NO_ANSWER;
+    }
+    if (crc8((uint8_t*)&ids[therm_bus], 8) == 0) {
+      *discrepancyMask = masks[therm_bus];
+      return ids[therm_bus];
+    }
   }
+  return THERM_BAD_CRC;
+}
 
-  // Start search
-  therm_write_byte(THERM_CMD_SEARCHROM);
-
-  for(position = 0; position < 64; position++) {
-    // Read the bit from the devices
-    normalBit     = therm_read_bit();
-    complementBit = therm_read_bit();
-
-    if (normalBit == 0 && complementBit == 0) {
-      //Active devices have different bits in current pos
-      //Check if this is the most significant bit in the
-      //discrepancyMask. If so, take the other route at this
-      //position (zero that is)
-      // Ex:
-      // 0000100101001 <- least significant
-      //     ^ ^  ^  <--- If current position is here:
-      //     | |  |
-      //     | |  +--We have more to investigate higher up,
-      //     | |     select bit = 1
-      //     | +-----We have been here already and are now in the
-      //     |       bit=0 branch
-      //     +-------Time to take the other route (bit = 0). Reset
-      //             the mask and go with bit = 0.
-
-      if ( (*discrepancyMask) & (L_ONE << position)) {
-        //Devices have different bits, and the mask is 1.
-        //If this is the most significant bit in the mask,
-        //we should try the other branch now (bit=0). We
-        //should also reset the mask here to indicate we
-        //are done with the 1-branch.
-        //If this is not the most sigificant bit, we need
-        //to keep investigating the 1-branch.
-        if ( (*discrepancyMask) < (L_ONE << (position+1))) {
-          //the mask is less than a 1 in the next position =>
-          //this is the most significant bit in the mask.
-
-          //reset the mask
-          (*discrepancyMask) ^= (L_ONE << position); //Use XOR - we now it is a one
-          selectedNextBit = 0;
-        } else {
-          //This is not the most significant bit. Keep investigating
-          //the 1-branch and leave the mask as is
-          selectedNextBit = 1;
-        }
+uint8_t therm_search_buses(uint8_t buses, uint8_t command, uint64_t* masks,
+                           uint64_t* ids) {
+  // Same as therm_search(), on all buses at once.
+  uint64_t start[OW_BUSES];
+  uint8_t found = 0, tries, bus;
+
+  memcpy(start, masks, sizeof(start));
+  for (tries = 0; tries < THERM_RETRIES && buses; tries++) {
+    ow_reset(buses, 0);
+    ow_wait();
+    buses &= ~ow_result();
+    if (!buses) {
+      break;
+    }
+    ow_write(buses, &command, 0, 8, 0);
+    ow_search(buses, masks, ids, 0);
+    ow_wait();
+    buses &= ~ow_result();
+
+    // Buses with a bad id search the same branch again.
+    for (bus = 0; bus < OW_BUSES; bus++) {
+      if (!(buses & (1 << bus))) {
+        continue;
+      }
+      if (crc8((uint8_t*)&ids[bus], 8) == 0) {
+        found |= 1 << bus;
+        buses &= ~(1 << bus);
       } else {
-        //Devices have different bits, but the mask is zero
-        //If we have passed the MSB of the mask, we have found
-        //a new discrepancy. Set the mask to 1, and go for the
-        //1-branch.
-        //If we have not passed the MSB, this means we have
-        //already investigated the 1-branch from this position and
-        //we should keep investigating the 0-branch.
-
-        if ( (*discrepancyMask) < (L_ONE << position)) {
-          //the mask is less than a 1 in the current position =>
-          //we have passed the MSB of the mask => we have found
-          //a new discrepancy
-          (*discrepancyMask) |= (L_ONE << position);
-          selectedNextBit = 1;
-        } else {
-          //We have not passed MSB => the 1-branch of this
-          //discrepancy have been searched already => keep
-          //going to the 0-branch.
-          selectedNextBit = 0;
-        }
+        masks[bus] = start[bus];
       }
-    } else if (normalBit && complementBit) {
-      //No good. No device responded.
-      return 0xFFFFFFFFFFFFFFFE;
-    } else {
-      //Bits differed. All active devices had the same bit
-      selectedNextBit = normalBit;
     }
-
-    // Update the deviceID with the read/selected bit
-    deviceID |= ((uint64_t)selectedNextBit << position);
-
-    // Write the selected bit to continue out in the tree.
-    therm_write_bit(selectedNextBit);
   }
-
-  return deviceID;
+  return found;
 }
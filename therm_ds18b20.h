@@ -1,3 +1,6 @@
+#ifndef THERM_DS18B20_H__
+#define THERM_DS18B20_H__
+
 #include <avr/io.h>
 #include <stdio.h>
 #define THERM_PORT PORTC
@@ -5,6 +8,12 @@
 #define THERM_PIN PINC
 #define THERM_DQI PC0
 
+// Independent 1-wire buses, all on THERM_PORT, as pin masks. Bus 0 is
+// THERM_DQI. They are run in lockstep by onewire.c. PC1 could be added if
+// the button is not used.
+#define THERM_BUSES 3
+#define THERM_BUS_PINS { (1 << PC0), (1 << PC2), (1 << PC3) }
+
 /* Utils */
 #define THERM_INPUT_MODE() THERM_DDR&=~(1<<THERM_DQI)
 #define THERM_OUTPUT_MODE() THERM_DDR|=(1<<THERM_DQI)
@@ -26,15 +35,67 @@
 #define THERM_CMD_ALARMSEARCH 0xec
 /* constants */
 #define THERM_DECIMAL_STEPS_12BIT 625 //.0625
+#define THERM_CONVERSION_MS 750 // Max conversion time at 12 bits
+// Max conversion time at 9-12 bits resolution, 94 ms at 9 bits and doubling
+// for each extra bit.
+#define THERM_CONVERSION_TIME(bits) ((uint16_t)94 << ((bits) - 9))
+// Configuration register (scratchpad byte 4) for a resolution, and back.
+#define THERM_CONFIG(bits) ((((bits) - 9) << 5) | 0x1F)
+#define THERM_RESOLUTION(config) ((((config) >> 5) & 0x03) + 9)
+// Scratchpad: temperature (2), TH, TL, configuration, reserved (3), crc
+#define THERM_SCRATCHPAD_LEN 9
+// Attempts at a scratchpad read or a search step before giving up
+#define THERM_RETRIES 3
+// therm_search() results that are not rom ids
+#define THERM_NO_DEVICES 0xFFFFFFFFFFFFFFFF // No presence pulse
+#define THERM_NO_ANSWER  0xFFFFFFFFFFFFFFFE // No device answered the search
+#define THERM_BAD_CRC    0xFFFFFFFFFFFFFFFD // Rom id crc failed every time
+#define THERM_ID_VALID(id) ((id) < THERM_BAD_CRC)
 
 
 
 void therm_delay(uint16_t delay);
+// Select the bus used by the calls below, except therm_convert() which
+// converts on all buses.
+void therm_use_bus(uint8_t bus);
+extern uint8_t therm_bus;
 uint8_t therm_reset();
 void therm_write_bit(uint8_t bit);
 uint8_t therm_read_bit(void);
 uint8_t therm_read_byte(void);
 void therm_write_byte(uint8_t byte);
+// Search the next device. See therm_search() in therm_ds18b20.c. Returns the
+// rom id, or one of THERM_NO_DEVICES, THERM_NO_ANSWER or THERM_BAD_CRC.
 uint64_t therm_search(uint64_t* dicrepancyMask);
-//
-void therm_read_temperature(int16_t* temp, uint64_t* id);
+// Start conversion on all devices. Returns immediately.
+void therm_convert();
+// True if a scratchpad read has a valid crc and configuration register. The
+// configuration check catches a line held low, which reads as all zeros
+// with a valid crc.
+uint8_t therm_scratchpad_valid(const uint8_t* scratchpad);
+// Read the temperature of the last conversion. id == 0 => skip rom. The
+// whole scratchpad is read and checked, up to THERM_RETRIES times. Returns 0
+// on success. Otherwise temp is set to -1.
+uint8_t therm_read_scratchpad(int16_t* temp, uint64_t* id);
+// Convert, busy wait and read.
+uint8_t therm_read_temperature(int16_t* temp, uint64_t* id);
+// Reset and address one device, or all if id == 0. Returns 0 if anyone
+// answered the reset.
+uint8_t therm_select(uint64_t* id);
+// Set resolution to 9-12 bits, keeping the alarm limits. If copy is set, the
+// setting is also copied to the device's eeprom to survive power loss.
+// Returns 0 on success.
+uint8_t therm_set_resolution(uint64_t* id, uint8_t bits, uint8_t copy);
+// Set the alarm limits in whole degrees, keeping the resolution. A sensor is
+// in alarm after a conversion if the whole degrees are at or above high, or
+// at or below low. Returns 0 on success.
+uint8_t therm_set_alarm(uint64_t* id, int8_t high, int8_t low, uint8_t copy);
+// Search the next rom id on several buses at once. command is
+// THERM_CMD_SEARCHROM for all devices, or THERM_CMD_ALARMSEARCH for those in
+// alarm. masks and ids are indexed by bus, see therm_search(). Returns the
+// mask of buses where an id with a valid crc was found. A bad crc is retried
+// from the same masks, up to THERM_RETRIES times.
+uint8_t therm_search_buses(uint8_t buses, uint8_t command, uint64_t* masks,
+                           uint64_t* ids);
+
+#endif
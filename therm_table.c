@@ -0,0 +1,596 @@
+#include "therm_table.h"
+#include "therm_ds18b20.h"
+#include "onewire.h"
+#include "eeprom.h"
+#include "globals.h"
+#include "crc8.h"
+#include <string.h>
+
+#define EE_THERM_PERIOD ((uint8_t*)0x16)
+#define EE_THERM_COUNT  ((uint8_t*)0x40) // Number of rom ids
+#define EE_THERM_IDS    ((uint8_t*)0x41) // 8 bytes per rom id
+#define EE_THERM_BUSES  ((uint8_t*)0xA1) // Bus of each rom id
+
+// Sampler states
+#define TT_IDLE       0
+#define TT_CONVERTING 1 // Convert command sent, or waiting for conversion
+#define TT_READING    2 // Reading one sensor per bus, ttRound
+#define TT_ALARMS     3 // Alarm search on ttAlarmBuses
+#define TT_ALARM_CONVERTING 4 // Conversion for the alarm search
+
+// Result of a background 1-wire transaction
+#define TT_RUNNING 0
+#define TT_OK      1
+#define TT_FAIL    2
+
+uint64_t therm_ids[THERM_TABLE_LEN];
+struct therm_value therm_values[THERM_TABLE_LEN];
+uint8_t therm_bits[THERM_TABLE_LEN]; // Resolution, 0 if not known yet
+uint8_t therm_buses[THERM_TABLE_LEN];
+struct therm_alarm therm_alarms[THERM_TABLE_LEN];
+uint8_t therm_errors[THERM_TABLE_LEN];
+uint8_t therm_table_len;
+
+uint8_t ttState;
+uint8_t ttBuses;             // Buses in the current transaction
+uint8_t ttRoundBuses;        // Buses with a sensor in the current round
+uint8_t ttNext[OW_BUSES];    // Where to look for the next sensor on each bus
+uint8_t ttRound[OW_BUSES];   // Sensor being read on each bus
+uint8_t ttTries[OW_BUSES];   // Failed reads of that sensor in a row
+uint8_t ttPeriod;         // Seconds between conversions
+uint8_t ttWait;           // Seconds left until next conversion
+uint16_t ttSecond;        // ticks_ms() when ages were last updated
+uint16_t ttStarted;       // ticks_ms() at start of conversion
+uint8_t ttCommand[OW_BUSES][10]; // Written by the transaction, per bus
+uint8_t ttScratch[OW_BUSES][THERM_SCRATCHPAD_LEN]; // Read by the transaction
+uint16_t ttConversion;    // ms to wait for the conversion
+volatile uint8_t ttResult;
+uint64_t ttAlarmMasks[OW_BUSES]; // Alarm search state per bus
+uint64_t ttAlarmIds[OW_BUSES];
+uint8_t ttAlarmBuses;     // Buses that might have more in alarm
+uint8_t ttAlarmTries;     // Searches restarted for a bad crc
+uint16_t ttAlarmFound;    // Table indexes found in alarm by the search
+uint16_t ttAlarms;        // Same, from the last complete search
+uint16_t ttAlarmsAge;     // Seconds since then
+uint8_t ttAlarmsWanted;   // Start a search when the sampler is idle
+
+int8_t therm_table_find(const uint64_t* id) {
+  uint8_t i;
+  for (i = 0; i < therm_table_len; i++) {
+    if (therm_ids[i] == *id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void tt_clear(uint8_t i, const uint64_t* id, uint8_t bus) {
+  therm_ids[i] = *id;
+  therm_values[i].temperature = 0;
+  therm_values[i].age = THERM_AGE_UNKNOWN;
+  therm_bits[i] = 0;
+  therm_buses[i] = bus;
+  therm_alarms[i].high = 0;
+  therm_alarms[i].low = 0;
+  therm_errors[i] = 0;
+}
+
+void tt_swap(uint8_t i, uint8_t j) {
+  uint64_t id = therm_ids[i];
+  struct therm_value value = therm_values[i];
+  uint8_t bits = therm_bits[i];
+  uint8_t bus = therm_buses[i];
+  struct therm_alarm alarm = therm_alarms[i];
+  uint8_t errors = therm_errors[i];
+
+  therm_ids[i] = therm_ids[j];
+  therm_values[i] = therm_values[j];
+  therm_bits[i] = therm_bits[j];
+  therm_buses[i] = therm_buses[j];
+  therm_alarms[i] = therm_alarms[j];
+  therm_errors[i] = therm_errors[j];
+  therm_ids[j] = id;
+  therm_values[j] = value;
+  therm_bits[j] = bits;
+  therm_buses[j] = bus;
+  therm_alarms[j] = alarm;
+  therm_errors[j] = errors;
+}
+
+void tt_error(uint8_t i) {
+  if (therm_errors[i] < 0xFF) {
+    therm_errors[i]++;
+  }
+}
+
+void therm_table_clear_errors() {
+  memset(therm_errors, 0, sizeof(therm_errors));
+}
+
+int8_t therm_table_add(const uint64_t* id, uint8_t bus) {
+  int8_t i = therm_table_find(id);
+  if (i >= 0) {
+    return i;
+  }
+  if (therm_table_len >= THERM_TABLE_LEN) {
+    return -1;
+  }
+  i = therm_table_len;
+  tt_clear(i, id, bus);
+  therm_table_len++;
+
+  eeWriteBlock(EE_THERM_IDS + 8 * i, (uint8_t*)id, 8);
+  eeWriteByte(EE_THERM_BUSES + i, bus);
+  eeWriteByte(EE_THERM_COUNT, therm_table_len);
+  return i;
+}
+
+void therm_table_get(const uint64_t* id, struct therm_entry* entry) {
+  int8_t i = therm_table_find(id);
+  int16_t value;
+  uint8_t bus, old_bus = therm_bus;
+
+  if (i >= 0) {
+    entry->id = *id;
+    entry->temperature = therm_values[i].temperature;
+    entry->age = therm_values[i].age;
+    return;
+  }
+
+  // Never seen before. Find the bus where it answers, without waiting for
+  // a conversion, and keep it from now on. The sampler reads it in the
+  // next period.
+  entry->id = *id;
+  entry->temperature = 0;
+  entry->age = THERM_AGE_UNKNOWN;
+  for (bus = 0; bus < OW_BUSES; bus++) {
+    therm_use_bus(bus);
+    if (therm_read_scratchpad(&value, &entry->id) == 0) {
+      therm_table_add(id, bus);
+      break;
+    }
+  }
+  therm_use_bus(old_bus);
+}
+
+uint8_t therm_table_enumerate() {
+  // Found sensors are moved to the front of the table, in the order found.
+  // Whatever is left behind them was not found and is dropped. All buses
+  // are searched at once.
+  uint64_t masks[OW_BUSES];
+  uint64_t ids[OW_BUSES];
+  uint8_t buses = OW_ALL_BUSES;
+  uint8_t found_on, bus;
+  uint8_t found = 0;
+  int8_t i;
+
+  // The sampler would lose track of the indexes. Start it over.
+  ttState = TT_IDLE;
+  ttWait = 0;
+  ttAlarms = 0;
+  ttAlarmsAge = THERM_AGE_UNKNOWN;
+
+  memset(masks, 0, sizeof(masks));
+  while (buses) {
+    found_on = therm_search_buses(buses, THERM_CMD_SEARCHROM, masks, ids);
+    for (bus = 0; bus < OW_BUSES; bus++) {
+      if (!(found_on & (1 << bus)) || masks[bus] == 0) {
+        buses &= ~(1 << bus); // No more on this bus
+      }
+      if (!(found_on & (1 << bus)) || found >= THERM_TABLE_LEN) {
+        continue;
+      }
+      i = therm_table_find(&ids[bus]);
+      if (i < 0) {
+        // New one. Take a free place, or one not found (yet).
+        i = therm_table_len < THERM_TABLE_LEN ? therm_table_len++
+                                              : THERM_TABLE_LEN - 1;
+        tt_clear(i, &ids[bus], bus);
+      }
+      therm_buses[i] = bus;
+      tt_swap(i, found);
+      found++;
+    }
+  }
+
+  therm_table_len = found;
+  eeWriteBlock(EE_THERM_IDS, (uint8_t*)therm_ids, 8 * found);
+  eeWriteBlock(EE_THERM_BUSES, therm_buses, found);
+  eeWriteByte(EE_THERM_COUNT, found);
+  return found;
+}
+
+uint8_t tt_set_one(uint64_t* id, int8_t index, const struct therm_alarm* alarm,
+                   uint8_t bits, uint8_t copy) {
+  // Set resolution, or alarm limits if alarm is given. Keep the table in
+  // step. Returns 0 on success.
+  if (alarm) {
+    if (therm_set_alarm(id, alarm->high, alarm->low, copy)) {
+      return 1;
+    }
+    if (index >= 0) {
+      therm_alarms[index] = *alarm;
+    }
+    return 0;
+  }
+  if (therm_set_resolution(id, bits, copy)) {
+    return 1;
+  }
+  if (index >= 0) {
+    therm_bits[index] = bits;
+  }
+  return 0;
+}
+
+uint8_t tt_set(const uint64_t* id, const struct therm_alarm* alarm,
+               uint8_t bits, uint8_t copy) {
+  uint8_t i, count = 0;
+  uint8_t old_bus = therm_bus;
+  int8_t index;
+  uint64_t one;
+
+  if (id) {
+    one = *id;
+    index = therm_table_find(id);
+    for (i = 0; i < OW_BUSES; i++) {
+      // Try the bus it is known to be on, or all.
+      if (index >= 0 && therm_buses[index] != i) {
+        continue;
+      }
+      therm_use_bus(i);
+      if (tt_set_one(&one, index, alarm, bits, copy) == 0) {
+        count = 1;
+        break;
+      }
+    }
+    therm_use_bus(old_bus);
+    return count;
+  }
+
+  for (i = 0; i < therm_table_len; i++) {
+    therm_use_bus(therm_buses[i]);
+    if (tt_set_one(&therm_ids[i], i, alarm, bits, copy) == 0) {
+      count++;
+    }
+  }
+  therm_use_bus(old_bus);
+  return count;
+}
+
+uint8_t therm_table_set_resolution(const uint64_t* id, uint8_t bits,
+                                   uint8_t copy) {
+  return tt_set(id, 0, bits, copy);
+}
+
+uint8_t therm_table_set_alarm(const uint64_t* id, int8_t high, int8_t low,
+                              uint8_t copy) {
+  struct therm_alarm alarm;
+  alarm.high = high;
+  alarm.low = low;
+  return tt_set(id, &alarm, 0, copy);
+}
+
+void therm_table_start_alarms() {
+  ttAlarmsWanted = 1;
+}
+
+uint16_t therm_table_alarms_age() {
+  return ttAlarmsAge;
+}
+
+uint8_t therm_table_alarms(struct therm_entry* entries, uint8_t max) {
+  uint8_t i, count = 0;
+
+  for (i = 0; i < therm_table_len && count < max; i++) {
+    if (ttAlarms & (1 << i)) {
+      entries[count].temperature = therm_values[i].temperature;
+      entries[count].id = therm_ids[i];
+      entries[count].age = therm_values[i].age;
+      count++;
+    }
+  }
+  return count;
+}
+
+uint16_t therm_table_conversion_ms() {
+  // The slowest sensor decides. Unknown ones might be at 12 bits.
+  uint8_t i, bits = 9;
+  for (i = 0; i < therm_table_len; i++) {
+    if (therm_bits[i] == 0) {
+      return THERM_CONVERSION_MS;
+    }
+    if (therm_bits[i] > bits) {
+      bits = therm_bits[i];
+    }
+  }
+  return therm_table_len ? THERM_CONVERSION_TIME(bits) : THERM_CONVERSION_MS;
+}
+
+uint8_t therm_table_period() {
+  uint8_t period = eeReadByte(EE_THERM_PERIOD);
+  return period == 0xFF ? THERM_PERIOD_DEFAULT : period;
+}
+
+void therm_table_set_period(uint8_t seconds) {
+  eeWriteByte(EE_THERM_PERIOD, seconds);
+  ttPeriod = therm_table_period();
+  ttWait = 0;
+}
+
+// The transactions below are chained by the 1-wire interrupt. They cannot
+// be split by the blocking therm_* calls, which wait for the whole chain.
+// They run on all buses in ttBuses at once.
+
+void tt_done() {
+  ttResult = TT_OK;
+}
+
+void tt_read_command_done() {
+  ow_read(ttBuses, ttScratch[0], sizeof(ttScratch[0]),
+          8 * THERM_SCRATCHPAD_LEN, tt_done);
+}
+
+void tt_reset_done() {
+  // ttCommand holds either SKIPROM, CONVERTTEMP for all buses, or
+  // MATCHROM, id, RSCRATCHPAD for each bus.
+  ttBuses &= ~ow_result(); // No presence pulse
+  if (!ttBuses) {
+    ttResult = TT_FAIL;
+    return;
+  }
+  if (ttState != TT_READING) {
+    ow_write(ttBuses, ttCommand[0], 0, 16, tt_done);
+  } else {
+    ow_write(ttBuses, ttCommand[0], sizeof(ttCommand[0]), 80,
+             tt_read_command_done);
+  }
+}
+
+void tt_start_convert() {
+  ttCommand[0][0] = THERM_CMD_SKIPROM;
+  ttCommand[0][1] = THERM_CMD_CONVERTTEMP;
+  ttBuses = OW_ALL_BUSES;
+  ttResult = TT_RUNNING;
+  ow_reset(ttBuses, tt_reset_done);
+}
+
+void tt_alarm_search_done() {
+  ttBuses &= ~ow_result(); // None (more) in alarm
+  ttResult = TT_OK;
+}
+
+void tt_alarm_command_done() {
+  ow_search(ttBuses, ttAlarmMasks, ttAlarmIds, tt_alarm_search_done);
+}
+
+void tt_alarm_reset_done() {
+  ttBuses &= ~ow_result(); // No presence pulse
+  if (!ttBuses) {
+    ttResult = TT_FAIL;
+    return;
+  }
+  ow_write(ttBuses, ttCommand[0], 0, 8, tt_alarm_command_done);
+}
+
+void tt_start_alarm_search() {
+  // Find the next sensor in alarm on each bus in ttAlarmBuses.
+  ttCommand[0][0] = THERM_CMD_ALARMSEARCH;
+  ttBuses = ttAlarmBuses;
+  ttResult = TT_RUNNING;
+  ow_reset(ttBuses, tt_alarm_reset_done);
+}
+
+void tt_start_alarms() {
+  // The sensors flagged themselves at the conversion. The alarm search
+  // walks only the flagged ones, so when all is well it is a single search
+  // of all buses.
+  memset(ttAlarmMasks, 0, sizeof(ttAlarmMasks));
+  ttAlarmBuses = OW_ALL_BUSES;
+  ttAlarmTries = 0;
+  ttAlarmFound = 0;
+  ttState = TT_ALARMS;
+  tt_start_alarm_search();
+}
+
+uint8_t tt_start_round() {
+  // Read the next sensor on each bus. Returns 0 when all are read.
+  uint8_t bus, i;
+
+  ttBuses = 0;
+  for (bus = 0; bus < OW_BUSES; bus++) {
+    for (i = ttNext[bus]; i < therm_table_len && therm_buses[i] != bus; i++) {
+      ;
+    }
+    ttNext[bus] = i + 1;
+    if (i >= therm_table_len) {
+      continue;
+    }
+    ttRound[bus] = i;
+    ttCommand[bus][0] = THERM_CMD_MATCHROM;
+    memcpy(&ttCommand[bus][1], &therm_ids[i], 8);
+    ttCommand[bus][9] = THERM_CMD_RSCRATCHPAD;
+    ttBuses |= 1 << bus;
+  }
+  if (!ttBuses) {
+    return 0;
+  }
+  ttRoundBuses = ttBuses;
+  ttResult = TT_RUNNING;
+  ow_reset(ttBuses, tt_reset_done);
+  return 1;
+}
+
+void therm_table_init() {
+  uint8_t i;
+
+  therm_table_len = eeReadByte(EE_THERM_COUNT);
+  if (therm_table_len > THERM_TABLE_LEN) {
+    therm_table_len = 0; // Cleared eeprom reads as FF.
+  }
+  eeReadBlock(EE_THERM_IDS, (uint8_t*)therm_ids, 8 * therm_table_len);
+  eeReadBlock(EE_THERM_BUSES, therm_buses, therm_table_len);
+  for (i = 0; i < therm_table_len; i++) {
+    therm_values[i].temperature = 0;
+    therm_values[i].age = THERM_AGE_UNKNOWN;
+    if (therm_buses[i] >= OW_BUSES) {
+      therm_buses[i] = 0; // Stored before there were several buses
+    }
+  }
+
+  ttPeriod = therm_table_period();
+  ttSecond = ticks_ms();
+  ttAlarmsAge = THERM_AGE_UNKNOWN;
+}
+
+void tt_poll_alarms() {
+  // A search is done. Sensors not in the table yet are added, and read from
+  // the next period on. A bad id searches the bus over.
+  uint8_t bus;
+  int8_t i;
+
+  if (ttResult == TT_FAIL) {
+    ttAlarmBuses = 0; // No one there
+  }
+  for (bus = 0; bus < OW_BUSES; bus++) {
+    if (!(ttAlarmBuses & (1 << bus))) {
+      continue;
+    }
+    if (!(ttBuses & (1 << bus))) {
+      ttAlarmBuses &= ~(1 << bus);
+      continue;
+    }
+    if (crc8((uint8_t*)&ttAlarmIds[bus], 8) != 0) {
+      if (++ttAlarmTries < THERM_RETRIES) {
+        ttAlarmMasks[bus] = 0;
+      } else {
+        ttAlarmBuses &= ~(1 << bus);
+      }
+      continue;
+    }
+    i = therm_table_add(&ttAlarmIds[bus], bus);
+    if (i >= 0) {
+      ttAlarmFound |= 1 << i;
+    }
+    if (ttAlarmMasks[bus] == 0) {
+      ttAlarmBuses &= ~(1 << bus); // That was the last one
+    }
+  }
+
+  if (ttAlarmBuses) {
+    tt_start_alarm_search();
+    return;
+  }
+  ttAlarms = ttAlarmFound;
+  ttAlarmsAge = 0;
+  ttState = TT_IDLE;
+}
+
+void therm_table_poll() {
+  uint8_t i, bus;
+
+  if ((uint16_t)(ticks_ms() - ttSecond) >= 1000) {
+    ttSecond += 1000;
+    for (i = 0; i < therm_table_len; i++) {
+      if (therm_values[i].age != THERM_AGE_UNKNOWN) {
+        therm_values[i].age++;
+      }
+    }
+    if (ttWait) {
+      ttWait--;
+    }
+    if (ttAlarmsAge != THERM_AGE_UNKNOWN) {
+      ttAlarmsAge++;
+    }
+  }
+
+  if (ttState == TT_IDLE && ttAlarmsWanted) {
+    // Converting and searching is all it takes, without reading anyone.
+    ttAlarmsWanted = 0;
+    ttConversion = therm_table_conversion_ms();
+    tt_start_convert();
+    ttStarted = ticks_ms();
+    ttState = TT_ALARM_CONVERTING;
+    return;
+  }
+
+  if (ttState == TT_IDLE) {
+    if (ttPeriod && ttWait == 0 && therm_table_len) {
+      ttWait = ttPeriod;
+      ttConversion = therm_table_conversion_ms();
+      tt_start_convert();
+      ttStarted = ticks_ms();
+      ttState = TT_CONVERTING;
+    }
+    return;
+  }
+
+  if (ttResult == TT_RUNNING) {
+    return;
+  }
+
+  if (ttState == TT_CONVERTING) {
+    if (ttResult == TT_FAIL) {
+      ttState = TT_IDLE;
+      return;
+    }
+    if ((uint16_t)(ticks_ms() - ttStarted) < ttConversion) {
+      return;
+    }
+    memset(ttNext, 0, sizeof(ttNext));
+    memset(ttTries, 0, sizeof(ttTries));
+    ttState = TT_READING;
+    if (!tt_start_round()) {
+      ttState = TT_IDLE;
+    }
+    return;
+  }
+
+  if (ttState == TT_ALARM_CONVERTING) {
+    if (ttResult == TT_FAIL) {
+      // No one on any bus, so no one in alarm
+      ttAlarms = 0;
+      ttAlarmsAge = 0;
+      ttState = TT_IDLE;
+      return;
+    }
+    if ((uint16_t)(ticks_ms() - ttStarted) >= ttConversion) {
+      tt_start_alarms();
+    }
+    return;
+  }
+
+  if (ttState == TT_ALARMS) {
+    tt_poll_alarms();
+    return;
+  }
+
+  // TT_READING. A missing sensor reads as all ones, which fails the crc. A
+  // failed read is counted, and retried in the next round without a new
+  // conversion. The resolution and alarm limits might have been set by
+  // someone else, or restored from the sensor's eeprom, so learn them here.
+  for (bus = 0; bus < OW_BUSES; bus++) {
+    if (!(ttRoundBuses & (1 << bus))) {
+      continue;
+    }
+    i = ttRound[bus];
+    if (ttResult != TT_OK || !(ttBuses & (1 << bus)) ||
+        !therm_scratchpad_valid(ttScratch[bus])) {
+      tt_error(i);
+      if (++ttTries[bus] < THERM_RETRIES) {
+        ttNext[bus] = i; // Same one again
+      } else {
+        ttTries[bus] = 0;
+      }
+      continue;
+    }
+    ttTries[bus] = 0;
+    therm_values[i].temperature = ttScratch[bus][0] | (ttScratch[bus][1] << 8);
+    therm_values[i].age = 0;
+    therm_bits[i] = THERM_RESOLUTION(ttScratch[bus][4]);
+    therm_alarms[i].high = ttScratch[bus][2];
+    therm_alarms[i].low = ttScratch[bus][3];
+  }
+  if (!tt_start_round()) {
+    ttState = TT_IDLE;
+  }
+}
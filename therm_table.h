@@ -0,0 +1,118 @@
+#ifndef THERM_TABLE_H__
+#define THERM_TABLE_H__
+
+#include <stdint.h>
+
+// DS18B20 table
+//
+// Known sensors are sampled in the background. Every period, one conversion
+// is started on all 1-wire buses, and when done, the scratchpad of each
+// sensor in the table is read. The buses are read in parallel, one sensor
+// per bus at a time, so the time taken depends on the bus with the most
+// sensors. Reads of parameter 0x22 are then answered from the
+// table, along with the age of the value.
+//
+// Sensors get into the table when the unit enumerates the buses (write to
+// parameter 0x29), when found by a search (parameter 0x21) or when read by
+// id. The rom ids are stored in eeprom and loaded at boot. Parameter 0x29
+// reads the whole rom list, and 0x2A all temperatures in the same order.
+//
+// Conversions are waited for as long as the slowest sensor needs at its
+// resolution, which is read along with each temperature and set with
+// parameter 0x2B. The alarm limits are also read along, and set with
+// parameter 0x2C. Parameter 0x2D starts a conversion and alarm search in
+// the background, without reading anyone, and replies with the sensors found
+// outside their limits by the last one. Sensors found that are not in the
+// table are added.
+//
+// Every read is checked with the scratchpad crc. A failed read is retried
+// up to THERM_RETRIES times in the next rounds, and counted per sensor.
+// Parameter 0x2E reads the counts, and clears them on write.
+//
+// The period in seconds is set with parameter 0x28 and stored in eeprom. 0
+// turns the sampling off. Cleared eeprom gives 10 s.
+
+#define THERM_TABLE_LEN 12
+#define THERM_PERIOD_DEFAULT 10
+#define THERM_AGE_UNKNOWN 0xFFFF
+
+// Latest value of a sensor. Laid out as the reply of parameter 0x2A.
+struct therm_value {
+  int16_t  temperature; // 1/16 degrees
+  uint16_t age;         // Seconds since read. Saturates at THERM_AGE_UNKNOWN,
+                        // which also means never read.
+};
+
+// Alarm limits in whole degrees. Laid out as the reply of parameter 0x2C.
+struct therm_alarm {
+  int8_t high;
+  int8_t low;
+};
+
+// Laid out as the reply of parameter 0x22, and of 0x2D per sensor.
+struct therm_entry {
+  int16_t  temperature;
+  uint64_t id;
+  uint16_t age;
+};
+
+// Rom ids, laid out as the reply of parameter 0x29, and their values.
+extern uint64_t therm_ids[THERM_TABLE_LEN];
+extern struct therm_value therm_values[THERM_TABLE_LEN];
+extern uint8_t therm_bits[THERM_TABLE_LEN]; // Resolution, 0 if unknown
+extern uint8_t therm_buses[THERM_TABLE_LEN]; // 1-wire bus of each sensor
+extern struct therm_alarm therm_alarms[THERM_TABLE_LEN]; // 0 until read
+extern uint8_t therm_errors[THERM_TABLE_LEN]; // Failed reads, saturating
+extern uint8_t therm_table_len;
+
+// Return the index of the sensor, or -1 if it is not in the table.
+int8_t therm_table_find(const uint64_t* id);
+
+// Add a sensor on a bus, unless there already. Return its index, or -1 if
+// full.
+int8_t therm_table_add(const uint64_t* id, uint8_t bus);
+
+// Copy the entry of a sensor to entry. A sensor not in the table is added
+// if it answers on some bus, with age THERM_AGE_UNKNOWN until the sampler
+// has read it.
+void therm_table_get(const uint64_t* id, struct therm_entry* entry);
+
+// Search the whole bus and make the table hold exactly the sensors found.
+// Values of sensors already known are kept. Returns the number found.
+uint8_t therm_table_enumerate();
+
+// Set the resolution (9-12 bits) of one sensor, or of all in the table if id
+// is 0. See therm_set_resolution(). Returns the number of sensors set.
+uint8_t therm_table_set_resolution(const uint64_t* id, uint8_t bits,
+                                   uint8_t copy);
+
+// Set the alarm limits of one sensor, or of all in the table if id is 0. See
+// therm_set_alarm(). Returns the number of sensors set.
+uint8_t therm_table_set_alarm(const uint64_t* id, int8_t high, int8_t low,
+                              uint8_t copy);
+
+// Convert on all buses and find the sensors in alarm with an alarm search,
+// in the background, as soon as the sampler is idle.
+void therm_table_start_alarms();
+
+// Seconds since the last alarm search was done. THERM_AGE_UNKNOWN if never.
+uint16_t therm_table_alarms_age();
+
+// Put the entries of the sensors found in alarm by the last alarm search,
+// at most max, in entries. Returns the number put there.
+uint8_t therm_table_alarms(struct therm_entry* entries, uint8_t max);
+
+void therm_table_clear_errors();
+
+// Conversion time of the slowest sensor in the table, in ms.
+uint16_t therm_table_conversion_ms();
+
+uint8_t therm_table_period();
+void therm_table_set_period(uint8_t seconds);
+
+void therm_table_init();
+
+// Called from the main loop to run the sampling.
+void therm_table_poll();
+
+#endif
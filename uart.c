@@ -1,161 +1,458 @@
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "uart.h"
 #include "hardware.h"
+#include "globals.h"
+#include "eeprom.h"
+#include "crc16.h"
+
+#define BAUD 19200 // Default baudrate. Always used by the bootloader.
+
+// If no valid frame is received for this long, alternate between the default
+// and the stored line settings, so that a master using either can reach us.
+#define BAUD_FALLBACK_MS 10000
+
+#define EE_BAUD ((uint8_t*)0x11) // 32 bit baudrate in eeprom
+#define EE_MODE ((uint8_t*)0x15) // Line mode in eeprom
+
+#define TX_PARTS 4 // Max number of parts in one transmission
+
+// Silence on the bus that terminates a frame, in ms (Timer2 ticks). A
+// character at 19200 baud takes 0.52 ms, and less at higher rates, so bytes
+// within a frame are never this far apart.
+#define RX_GAP_MS 2
+
+// Frames with this bit set in the command (except the legacy error 0xFF)
+// end with a 16 bit crc instead of the 8 bit sum. See bull.h.
+#define CRC_FRAME(cmd) (((cmd) & 0x40) && (cmd) != 0xFF)
+
+// Frames that are not requests (see bull.h) are not handed to the main loop,
+// except for search replies (parameter 0x08).
+#define REPLY_FRAME(cmd) ((cmd) == 0xFF || ((cmd) & 0x03) != 0x01)
+
+// States of the frame buffers in serialbuffer
+#define RX_FREE  0 // Can be filled by the receive interrupt
+#define RX_READY 1 // Holds a complete frame, not yet picked up
+#define RX_BUSY  2 // Handed to the main loop by uart_frame()
+
+struct uart_part txParts[TX_PARTS]; // Transmission walked by interrupt
+uint8_t txCount;              // Number of parts in txParts
+uint8_t txIndex;              // Next part to send
+const uint8_t* txPtr;         // Next byte to send in current part
+uint8_t txLeft;               // Bytes left in current part
+uint8_t txType;               // Type of current part
+uint8_t txSum;                // Sum of all bytes sent
+uint16_t txCrc;               // Crc of all bytes sent
+uint16_t txCrcOut;            // Crc being sent
+volatile uint8_t sndActive;   // Set until transmit complete
+
+uint32_t baudCurrent;         // Baudrate in use
+uint32_t baudStored;          // Baudrate from eeprom
+uint8_t modeCurrent;          // Line mode in use
+uint8_t modeStored;           // Line mode from eeprom
+volatile uint16_t baudSilent; // ms since last valid frame
+uint8_t rxAddress;            // Our address, for 9 bit mode
+
+volatile uint8_t rxState[RX_FRAMES];
+uint8_t rxLength[RX_FRAMES];  // Length of the frame in each buffer
+uint8_t rxFill;               // Buffer currently filled by interrupt
+uint8_t rxNext;               // Buffer to hand to the main loop next
+uint8_t rxPos;                // Bytes received into current frame
+uint8_t rxTotal;              // Expected length of current frame
+uint8_t rxSkip;               // Drop bytes until the bus goes quiet
+uint8_t rxDiscard;            // Receive current frame, but do not keep it
+volatile uint16_t rxQuiet;    // ms since last received byte. Saturates.
+
+uint8_t uart_transmit();
+
+void uart_rx_sleep() {
+  // In 9 bit mode, let only address bytes through until the next request
+  // for us. Called with interrupts disabled.
+  if (modeCurrent == UART_MODE_9BIT) {
+    UCSR0A = (1 << U2X0) | (1 << MPCM0);
+  }
+}
 
-#define BAUD 19200
-
-#define RECV_BUFFER_LEN 16
-#define SEND_BUFFER_LEN 16
+uint8_t uart_baud_valid(uint32_t baud) {
+  // Only accept rates that can be generated exactly in double speed mode,
+  // with a divisor that fits the 12 bits of UBRR0, or the default rate.
+  if (baud == BAUD) {
+    return 1;
+  }
+  return baud && baud <= F_CPU/8 && (F_CPU/8) % baud == 0 &&
+    F_CPU/8/baud <= 4096;
+}
 
-uint8_t rcvBuffer[RECV_BUFFER_LEN];
-uint8_t sndBuffer[SEND_BUFFER_LEN];
-uint8_t sndHead;
-uint8_t sndTail;
-uint8_t rcvHead;
-uint8_t rcvTail;
+void uart_use_line(uint32_t baud, uint8_t mode) {
+  // Set baudrate
+  unsigned int ubrr = F_CPU/8/baud - 1;
+  UBRR0H = ubrr >> 8;
+  UBRR0L = ubrr & 0xFF;
+  baudCurrent = baud;
+  baudSilent = 0;
+
+  // Set frame format. In 9 bit mode, everything we send has the 9th bit
+  // (TXB80) cleared, so it never wakes up the other units.
+  modeCurrent = mode;
+  if (mode == UART_MODE_9BIT) {
+    UCSR0B = (UCSR0B & ~(1 << TXB80)) | (1 << UCSZ02);
+  } else {
+    UCSR0B &= ~((1 << UCSZ02) | (1 << TXB80));
+  }
+  // Double speed mode, and in 9 bit mode wait for an address byte.
+  UCSR0A = (1 << U2X0);
+  uart_rx_sleep();
 
-extern uint16_t countdown_timer; // From main.c
+  // Whatever we were receiving was on the old settings.
+  rxSkip = 1;
+}
 
-void uart_transmit();
+void uart_store_line() {
+  // The settings in use become the ones we fall back from.
+  if (baudCurrent != baudStored) {
+    baudStored = baudCurrent;
+    eeWriteBlock(EE_BAUD, (uint8_t*)&baudStored, 4);
+  }
+  if (modeCurrent != modeStored) {
+    modeStored = modeCurrent;
+    eeWriteByte(EE_MODE, modeStored);
+  }
+}
 
 void uart_setup() {
-  sndHead = 0;
-  sndTail = 0;
-  rcvHead = 0;
-  rcvTail = 0;
-
-  // Set baudrate
-  unsigned int ubrr = F_CPU/8/BAUD - 1;
-  UBRR0H = ubrr >> 8;
-  UBRR0L = ubrr & 0xFF;
+  uint8_t i;
+  txCount = 0;
+  txIndex = 0;
+  txLeft = 0;
 
-  // Set double speed mode
-  UCSR0A = (1 << U2X0);
+  for (i = 0; i < RX_FRAMES; i++) {
+    rxState[i] = RX_FREE;
+  }
+  rxFill = 0;
+  rxNext = 0;
+  rxPos = 0;
+  rxSkip = 0;
+  rxDiscard = 0;
+  rxQuiet = 0;
+  sndActive = 0;
+
+  eeReadBlock(EE_BAUD, (uint8_t*)&baudStored, 4);
+  if (!uart_baud_valid(baudStored)) {
+    // Cleared eeprom reads as FFFFFFFF.
+    baudStored = BAUD;
+  }
+  modeStored = eeReadByte(EE_MODE);
+  if (modeStored != UART_MODE_9BIT) {
+    modeStored = UART_MODE_8BIT;
+  }
 
   // Enable receiver and transmitter and interrupts
   UCSR0B = (1<<RXEN0) | (1<<TXEN0) | (1 << RXCIE0) | (1 << TXCIE0);
 
-  // Set frame format: 8data, 1stop bit
+  // Set frame format: 8data (9 with UCSZ02), 1stop bit
   UCSR0C = (3<<UCSZ00);
+
+  uart_use_line(baudStored, modeStored);
+  rxSkip = 0;
+}
+
+void uart_wait_sent() {
+  while (sndActive) {
+    ;
+  }
 }
 
-void uart_putc(uint8_t byte) {
-  uint8_t tail;
+void uart_send(const struct uart_part* parts, uint8_t count) {
+  uint8_t i;
 
-  // Busy-wait for room in the buffer
-  do {
-    cli(); // sndTail is moved by interrupt. Disable temporarily.
-    tail = sndTail;
-    sei();
-  } while (sndHead - tail >= SEND_BUFFER_LEN);
+  // The previous transmission is still reading its parts.
+  uart_wait_sent();
 
-  sndBuffer[sndHead % SEND_BUFFER_LEN] = byte;
-  sndHead++;
+  count = count > TX_PARTS ? TX_PARTS : count; // Truncate list
+  for (i = 0; i < count; i++) {
+    txParts[i] = parts[i];
+  }
+  txCount = count;
+  txIndex = 0;
+  txLeft = 0;
+  txSum = 0;
+  txCrc = CRC16_INIT;
 
-  if (!(UCSR0B & (1 << UDRIE0))) {
-    // Transmit interrupt is not enabled. We must start sending
-    cli();
-    rs485_direction_out();
-    uart_transmit();
+  cli();
+  sndActive = 1;
+  rs485_direction_out();
+  if (uart_transmit()) {
     UCSR0B |= (1 << UDRIE0); // Enable transmit interrupt.
-    sei();
+  } else {
+    // Nothing at all to send. There will be no transmit complete.
+    rs485_direction_in();
+    sndActive = 0;
   }
+  sei();
+}
 
-  // Rewind send pointers to between 0 and SEND_BUFFER_LEN
-  while (sndTail >= SEND_BUFFER_LEN) {
-    cli();
-    sndTail -= SEND_BUFFER_LEN;
-    sei();
-    sndHead -= SEND_BUFFER_LEN;
+uint8_t* uart_frame(uint8_t* length) {
+  if (rxState[rxNext] != RX_READY) {
+    return 0;
   }
+  // Only the main loop moves a buffer out of READY, so no need for cli().
+  rxState[rxNext] = RX_BUSY;
+  *length = rxLength[rxNext];
+  return serialbuffer[rxNext];
 }
 
-void uart_puts(const char* str) {
-  while (*str) {
-    uart_putc(*str);
-    str++;
+void uart_frame_done() {
+  if (rxState[rxNext] != RX_BUSY) {
+    return;
   }
+  rxState[rxNext] = RX_FREE;
+  rxNext = (rxNext + 1) % RX_FRAMES;
 }
 
-uint8_t uart_available() {
-  uint8_t count;
+void uart_flush() {
+  uint8_t i;
+  cli();
+  for (i = 0; i < RX_FRAMES; i++) {
+    if (rxState[i] == RX_READY) {
+      rxState[i] = RX_FREE;
+    }
+  }
+  // Receive into the buffer after the one the main loop is working on.
+  rxFill = rxNext;
+  if (rxState[rxNext] == RX_BUSY) {
+    rxFill = (rxNext + 1) % RX_FRAMES;
+  }
+  if (rxPos) {
+    // A partial frame was received. Its buffer might have moved.
+    rxSkip = 1;
+  }
+  uart_rx_sleep();
+  sei();
+}
 
+uint16_t uart_quiet_ms() {
+  uint16_t quiet;
   cli();
-  count = rcvHead - rcvTail;
+  quiet = rxQuiet;
   sei();
+  return quiet;
+}
+
+void uart_set_baud(uint32_t baud) {
+  if (!uart_baud_valid(baud)) {
+    return;
+  }
+
+  // Let the reply to the request go out on the old rate first.
+  uart_wait_sent();
 
-  return count;
+  cli();
+  uart_use_line(baud, modeCurrent);
+  sei();
+  uart_store_line();
 }
 
-uint8_t* uart_getc(unsigned int timeout, idler_t idler) {
-  uint8_t head;
-  uint8_t *p;
-  uint8_t done = 0;
+uint32_t uart_baud() {
+  uint32_t baud;
   cli();
-  head = rcvHead;
-  countdown_timer = timeout;
+  baud = baudCurrent;
   sei();
-  while (head == rcvTail) {
-    if (done) {
-      // No data in buffer
-      return 0;
-    }
-    if (idler) {
-      idler();
-    }
+  return baud;
+}
 
-    cli();
-    head = rcvHead;
-    done = (countdown_timer == 0);
-    sei();
+void uart_set_mode(uint8_t mode) {
+  if (mode != UART_MODE_8BIT && mode != UART_MODE_9BIT) {
+    return;
   }
 
-  p = &rcvBuffer[rcvTail % RECV_BUFFER_LEN];
-  rcvTail++;
+  // Let the reply to the request go out in the old mode first.
+  uart_wait_sent();
 
-  while (rcvTail >= RECV_BUFFER_LEN) {
-    rcvTail -= RECV_BUFFER_LEN;
-    cli(); // Head is moved by interrupt. Disable them
-    rcvHead -= RECV_BUFFER_LEN;
-    sei();
+  cli();
+  uart_use_line(baudCurrent, mode);
+  sei();
+  uart_store_line();
+}
+
+uint8_t uart_mode() {
+  return modeCurrent;
+}
+
+void uart_set_address(uint8_t address) {
+  rxAddress = address;
+}
+
+void uart_frame_valid() {
+  cli();
+  baudSilent = 0;
+  sei();
+}
+
+void uart_tick() {
+  // Timer2 interrupt runs with interrupts enabled. Do not let the receive
+  // interrupt reset the counter between our read and write.
+  cli();
+  if (rxQuiet != 0xFFFF) {
+    rxQuiet++;
+  }
+  if (rxQuiet == RX_GAP_MS && rxPos) {
+    // The frame was cut short. Wait for the next address byte.
+    uart_rx_sleep();
   }
 
-  return p;
+  if ((baudStored != BAUD || modeStored != UART_MODE_8BIT) && !sndActive) {
+    baudSilent++;
+    if (baudSilent >= BAUD_FALLBACK_MS) {
+      if (baudCurrent == baudStored && modeCurrent == modeStored) {
+        uart_use_line(BAUD, UART_MODE_8BIT);
+      } else {
+        uart_use_line(baudStored, modeStored);
+      }
+    }
+  }
+  sei();
 }
 
-void uart_transmit() {
-  // Put next byte in UART or stop transmission
+uint8_t uart_transmit() {
+  // Put next byte in UART or stop transmission. Returns 0 when done.
   // Called by transmit interrupt or when starting new transmission.
+  uint8_t byte;
 
-  if (sndHead == sndTail) {
-    // Nothing to send
-    UCSR0B &= ~(1 << UDRIE0); // Disable transmit interrupt.
-    return;
+  while (txLeft == 0) {
+    // Current part is done. Move on to the next one.
+    if (txIndex >= txCount) {
+      // Nothing to send
+      UCSR0B &= ~(1 << UDRIE0); // Disable transmit interrupt.
+      return 0;
+    }
+    txPtr = txParts[txIndex].data;
+    txLeft = txParts[txIndex].len;
+    txType = txParts[txIndex].type;
+    txIndex++;
+
+    if (txType == UART_SUM) {
+      // Send the sum of everything sent so far
+      txLeft = 0;
+      UDR0 = txSum;
+      return 1;
+    }
+    if (txType == UART_CRC) {
+      // Send the crc of everything sent so far, low byte first
+      txCrcOut = txCrc;
+      txPtr = (const uint8_t*)&txCrcOut;
+      txLeft = 2;
+      txType = UART_RAM;
+    }
   }
 
-  /*
-  // Wait for empty transmit buffer
-  while (!(UCSR0A & (1<<UDRE0))) {
-    ;
+  if (txType == UART_PGM) {
+    byte = pgm_read_byte(txPtr);
+  } else {
+    byte = *txPtr;
   }
-  */
+  txPtr++;
+  txLeft--;
+  txSum += byte; // Sum with overflow
+  txCrc = crc16_update(txCrc, byte);
 
   // Put data into buffer, sends the data
-  UDR0 = sndBuffer[sndTail % SEND_BUFFER_LEN];
-
-  // Increment buffer pointer
-  sndTail++;
+  UDR0 = byte;
+  return 1;
 }
 
 ISR (USART_RX_vect) {
-  if (rcvHead - rcvTail >= RECV_BUFFER_LEN) {
-    // overflow! Handle?
-    ;
-  } else {
-    rcvBuffer[rcvHead % RECV_BUFFER_LEN] = UDR0;
-    rcvHead++;
+  // Assemble bull frames directly in the frame buffers. A frame ends when
+  // its length field says so. Anything we cannot make sense of is dropped
+  // until the bus has been quiet for RX_GAP_MS, where the next frame starts.
+  // In 9 bit mode, the address byte has the 9th bit set and always starts a
+  // frame. MPCM0 keeps the rest of a request for someone else from ever
+  // reaching us.
+  uint8_t status = UCSR0A; // Must be read before UDR0
+  uint8_t bit9 = modeCurrent == UART_MODE_9BIT && (UCSR0B & (1 << RXB80));
+  uint8_t byte = UDR0;
+  uint8_t *frame;
+
+  if (rxQuiet >= RX_GAP_MS || bit9) {
+    // Silence before this byte, or an address byte. It is the start of a
+    // new frame.
+    rxPos = 0;
+    rxSkip = 0;
+    rxDiscard = 0;
+  }
+  rxQuiet = 0;
+
+  if (status & ((1 << FE0) | (1 << DOR0))) {
+    // Framing error or overrun. This frame is garbage.
+    rxSkip = 1;
+  } else if (bit9) {
+    // A clean address byte proves that we use the same settings as the bus,
+    // even if it is not for us.
+    baudSilent = 0;
+    if (byte != rxAddress && byte != 0xFF) {
+      rxSkip = 1;
+    } else {
+      // For us. Receive the data bytes too.
+      UCSR0A = (1 << U2X0);
+    }
+  }
+
+  if (rxSkip) {
+    uart_rx_sleep();
+    return;
+  }
+
+  if (rxPos == 0 && rxState[rxFill] != RX_FREE) {
+    // Both buffers are in use. We have to drop this frame.
+    rxSkip = 1;
+    uart_rx_sleep();
+    return;
+  }
+
+  frame = serialbuffer[rxFill];
+  frame[rxPos] = byte;
+  rxPos++;
+
+  if (rxPos == 3 && REPLY_FRAME(frame[1]) && byte != 0x08) {
+    // Not for us. Just count the bytes to find the next frame.
+    rxDiscard = 1;
+    if (modeCurrent == UART_MODE_9BIT) {
+      // No need to count. The next frame starts with an address byte.
+      rxSkip = 1;
+      rxPos = 0;
+      uart_rx_sleep();
+      return;
+    }
+  }
+
+  if (rxPos == 4) {
+    // Header, payload and one or two bytes of checksum
+    if (byte > SERIALBUFSIZE - 5 - CRC_FRAME(frame[1])) {
+      // Larger message than we can handle, or a corrupt length byte.
+      rxSkip = 1;
+      uart_rx_sleep();
+      return;
+    }
+    rxTotal = byte + 5 + CRC_FRAME(frame[1]);
+  }
+
+  if (rxPos >= 5 && rxPos == rxTotal && frame[2] != 0x08) {
+    // End of frame. Search replies from the other units carry no address
+    // byte, so stay awake for them after a search frame.
+    uart_rx_sleep();
+  }
+
+  if (rxPos >= 5 && rxPos == rxTotal && rxDiscard) {
+    // Complete frame that nobody wants. Reuse the buffer.
+    rxPos = 0;
+    rxDiscard = 0;
+  } else if (rxPos >= 5 && rxPos == rxTotal) {
+    // Complete frame. Hand it over and continue with the next buffer.
+    rxLength[rxFill] = rxPos;
+    rxState[rxFill] = RX_READY;
+    rxFill = (rxFill + 1) % RX_FRAMES;
+    rxPos = 0;
   }
 }
 
@@ -165,10 +462,12 @@ ISR (USART_UDRE_vect) {
 }
 
 ISR (USART_TX_vect) {
-  // Transmit complete. Time to change directon on RS485?
-  if (sndHead == sndTail) {
+  // Transmit complete. Time to change directon on RS485? The interrupt
+  // might have been late refilling UDR0, so check that we are really done.
+  if (txLeft == 0 && txIndex >= txCount) {
     // Nothing to send
     // Set RS485 direction back to IN
     rs485_direction_in();
+    sndActive = 0;
   }
 }
@@ -1,25 +1,81 @@
 #ifndef UART_H__
-#define UART_H_
+#define UART_H__
 
 #include <stdint.h>
 
-// Type of idler function that is called while waiting for uart receive timeout
-typedef void (*idler_t)(void);
-
 // Setup port with interrupts, baudrate etc
 void uart_setup();
 
-// Queue one byte for sending. Will block until there is room in the buffer.
-void uart_putc(uint8_t);
+// Types of parts in a transmission
+#define UART_RAM 0 // len bytes from RAM
+#define UART_PGM 1 // len bytes from PROGMEM
+#define UART_SUM 2 // One byte, the 8 bit sum of everything sent before it
+#define UART_CRC 3 // Two bytes, the crc16 of everything sent before it
+
+// One part of a transmission. The transmit interrupt reads the data directly
+// from where it points, so it must be left untouched until sent.
+struct uart_part {
+  const uint8_t* data;
+  uint8_t len;
+  uint8_t type;
+};
+
+// Start sending a list of at most 4 parts. The list itself is copied. Waits
+// for any previous transmission, but returns as soon as this one is started.
+void uart_send(const struct uart_part* parts, uint8_t count);
+
+// Busy-wait until the last transmission is completely sent.
+void uart_wait_sent();
+
+// Return pointer to the oldest complete frame assembled by the receive
+// interrupt, or NULL if there is none. The frame length is stored in length.
+// The buffer belongs to the caller until uart_frame_done() is called, while
+// the next frame is received into the other buffer.
+uint8_t* uart_frame(uint8_t* length);
+
+// Release the frame returned by uart_frame().
+void uart_frame_done();
+
+// Drop all received frames that have not yet been picked up. In 9 bit mode,
+// wait for the next address byte.
+void uart_flush();
+
+// Return number of ms since the last byte was received. Saturates at 0xFFFF.
+// In 9 bit mode, bytes after an address byte for others are not seen.
+uint16_t uart_quiet_ms();
+
+// Return true if the baudrate can be generated exactly (or is the default).
+uint8_t uart_baud_valid(uint32_t baud);
+
+// Switch to a new baudrate once the current transmission is done, and store
+// it in eeprom. Invalid rates are ignored.
+void uart_set_baud(uint32_t baud);
+
+// Return the baudrate in use.
+uint32_t uart_baud();
+
+// Line modes
+#define UART_MODE_8BIT 0 // Plain 8N1
+#define UART_MODE_9BIT 1 // 9 data bits. Only the address byte has the 9th bit
+                         // set. Units only wake up for address bytes (MPCM)
+                         // until a request for them comes.
+
+// Switch to a new line mode once the current transmission is done, and
+// store it in eeprom. Falls back like the baudrate does.
+void uart_set_mode(uint8_t mode);
+
+// Return the line mode in use.
+uint8_t uart_mode();
 
-// Return number of bytes waiting in receive buffer
-uint8_t uart_available();
+// Set the address that frames must have to be received in 9 bit mode.
+// Broadcast (0xFF) is always received.
+void uart_set_address(uint8_t address);
 
-// Return pointer to next character in receive buffer. Returns NULL if no
-// data is is available within timeout ms.
-uint8_t* uart_getc(unsigned int timeout, idler_t idler);
+// Report that a frame with a valid checksum was received. Without these, the
+// uart alternates between the stored and the default line settings.
+void uart_frame_valid();
 
-// Send nullterminated string.
-void uart_puts(const char* str);
+// Called from the 1kHz timer interrupt to measure gaps between bytes.
+void uart_tick();
 
 #endif
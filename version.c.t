@@ -16,3 +16,7 @@ uint8_t version_length() {
 uint8_t version_char(uint8_t pos) {
   return pgm_read_byte(&(strVERSION[pos]));
 }
+
+const char* version_string() {
+  return strVERSION;
+}
@@ -5,5 +5,6 @@
 
 uint8_t version_length();
 uint8_t version_char(uint8_t pos);
+const char* version_string(); // In PROGMEM
 
 #endif
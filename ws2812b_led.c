@@ -1,6 +1,12 @@
 #include "ws2812b_led.h"
 #include "hardware.h"
+#include "eeprom.h"
+#include "globals.h"
+#include <string.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define EE_WSLED_BRIGHTNESS ((uint8_t*)0x17)
 
 /*
 Module to handle adressable leds
@@ -112,10 +118,124 @@ void wsled_sendByte(uint8_t byte) {
   }
 }
 
-void wsled_color(uint8_t r, uint8_t g, uint8_t b) {
-  // Neopixel wants them green, red, blue.
-  wsled_sendByte(g);
-  wsled_sendByte(r);
-  wsled_sendByte(b);
+/*
+# Frame buffer
+
+The colors are kept in wsledFrame, in the order sent (green, red, blue), and
+the whole chain up to the highest led set is sent from wsled_poll() when
+something changed. Brightness and gamma are applied to each byte on the way
+out, between bits where the line is low anyway. The bus handler only copies
+into the buffer.
+
+PC5 has no USART or SPI function, so the bits are still timed by the code
+above. Interrupts are only held off for the short high part of zero bits.
+An interrupt in the low part stretches it, which the leds accept as long as
+it stays shorter than the latch time.
+*/
+
+// Gamma 2.2, for 8 bit values
+const uint8_t wsled_gamma[256] PROGMEM = {
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+    3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+    6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+   12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+   20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+   30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+   42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+   56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+   73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+   91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+  113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+  137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+  163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+  192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+  223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+uint8_t wsledFrame[3 * WSLED_COUNT]; // Green, red, blue per led
+uint8_t wsledLength;                 // Leds to send
+uint8_t wsledDirty;
+uint8_t wsledBrightness;
+uint16_t wsledSent;                  // ticks_ms() at end of last frame
+
+void wsled_set(uint8_t first, const uint8_t* rgb, uint8_t count) {
+  uint8_t* frame = &wsledFrame[3 * first];
+
+  if (first >= WSLED_COUNT) {
+    return;
+  }
+  if (count > WSLED_COUNT - first) {
+    count = WSLED_COUNT - first;
+  }
+  if (first + count > wsledLength) {
+    wsledLength = first + count;
+  }
+  while (count--) {
+    // Neopixel wants them green, red, blue.
+    frame[0] = rgb[1];
+    frame[1] = rgb[0];
+    frame[2] = rgb[2];
+    frame += 3;
+    rgb += 3;
+  }
+  wsledDirty = 1;
+}
+
+void wsled_set_pixel(uint8_t index, uint8_t r, uint8_t g, uint8_t b) {
+  uint8_t rgb[3] = { r, g, b };
+  wsled_set(index, rgb, 1);
+}
+
+void wsled_write(uint16_t offset, const uint8_t* rgb, uint8_t len) {
+  // Red and green swap places in the frame.
+  uint8_t led, color;
+
+  while (len-- && offset < 3 * WSLED_COUNT) {
+    led = offset / 3;
+    color = offset % 3;
+    if (color < 2) {
+      color ^= 1;
+    }
+    wsledFrame[3 * led + color] = *rgb++;
+    if (led >= wsledLength) {
+      wsledLength = led + 1;
+    }
+    offset++;
+  }
+  wsledDirty = 1;
+}
+
+uint8_t wsled_brightness() {
+  return wsledBrightness;
+}
+
+void wsled_set_brightness(uint8_t brightness) {
+  wsledBrightness = brightness;
+  eeWriteByte(EE_WSLED_BRIGHTNESS, brightness);
+  wsledDirty = 1;
+}
+
+void wsled_init() {
+  wsledBrightness = eeReadByte(EE_WSLED_BRIGHTNESS); // Cleared is full
+}
+
+void wsled_poll() {
+  uint16_t i;
+  uint8_t value;
+  uint16_t now = ticks_ms();
+
+  // Let the last frame latch before starting the next, or it would just
+  // continue down the chain. The tick might come right after the frame, so
+  // wait for two to get a full ms, well over the 280 us reset.
+  if (!wsledDirty || (uint16_t)(now - wsledSent) < 2) {
+    return;
+  }
+  wsledDirty = 0;
+  for (i = 0; i < 3 * wsledLength; i++) {
+    value = ((uint16_t)wsledFrame[i] * (wsledBrightness + 1)) >> 8;
+    wsled_sendByte(pgm_read_byte(&wsled_gamma[value]));
+  }
+  wsledSent = ticks_ms();
 }
 
@@ -3,11 +3,40 @@
 
 #include <stdint.h>
 
+// WS2812B led chain on PC5
+//
+// Colors are set in a frame buffer, and sent by wsled_poll() from the main
+// loop. Brightness and gamma are applied when sent, so the buffer holds the
+// colors as given.
 
-// Add the color of the next led in line. Returns when bits have been sent.
-// Each call leaves the output low, meaning that if the function is not
-// called within 60µs, the leds consider this a reset.
-void wsled_color(uint8_t r, uint8_t g, uint8_t b);
+// Leds in the frame buffer, 3 bytes of RAM each. Longer chains are set
+// with chunked writes of transfer object XFER_LEDS (see xfer.h). 32 is what
+// fits next to the sensor table, flash log and time series. A unit that
+// drives a long chain can be built with more, up to 255, like
+// make CPPFLAGS=-DWSLED_COUNT=100, when RAM allows.
+#ifndef WSLED_COUNT
+#define WSLED_COUNT 32
+#endif
+#if WSLED_COUNT > 255
+#error Leds are indexed by uint8_t
+#endif
+
+// Set leds first to first + count - 1 from red, green, blue triplets. Leds
+// past WSLED_COUNT are ignored.
+void wsled_set(uint8_t first, const uint8_t* rgb, uint8_t count);
+void wsled_set_pixel(uint8_t index, uint8_t r, uint8_t g, uint8_t b);
+
+// Set len bytes of red, green, blue, from byte offset (3 bytes per led).
+// Bytes past the frame buffer are ignored.
+void wsled_write(uint16_t offset, const uint8_t* rgb, uint8_t len);
+
+// Brightness 0-255, stored in eeprom. Cleared eeprom is full brightness.
+uint8_t wsled_brightness();
+void wsled_set_brightness(uint8_t brightness);
+
+void wsled_init();
 
+// Called from the main loop. Sends the frame if it changed.
+void wsled_poll();
 
 #endif
@@ -0,0 +1,100 @@
+#include "xfer.h"
+#include "ws2812b_led.h"
+#include "led_anim.h"
+#include "flash_log.h"
+#include "series.h"
+#include "globals.h"
+#include <avr/io.h>
+
+struct xfer_status xfer_status;
+
+uint8_t xfer_readable(uint8_t object) {
+  return object == XFER_FLASH || object == XFER_LOG ||
+    object == XFER_SERIES;
+}
+
+uint8_t xfer_read(uint8_t object, uint32_t offset, uint8_t len,
+                  struct uart_part* part) {
+  uint32_t size;
+
+  switch (object) {
+  case XFER_LOG:
+    // Only the records held, from the sequence number in offset
+    part->data = temp.buf;
+    part->type = UART_RAM;
+    part->len = flash_log_read(offset, temp.buf, len);
+    return part->len;
+  case XFER_SERIES:
+    // Encoded on the fly from the ring
+    part->data = temp.buf;
+    part->type = UART_RAM;
+    part->len = series_read(offset, temp.buf, len);
+    return part->len;
+  case XFER_FLASH:
+    size = (uint32_t)FLASHEND + 1;
+    part->data = (const uint8_t*)(uint16_t)offset;
+    part->type = UART_PGM;
+    break;
+  default:
+    size = 0;
+    break;
+  }
+
+  if (offset >= size) {
+    len = 0;
+  } else if (len > size - offset) {
+    len = size - offset;
+  }
+  part->len = len;
+  return len;
+}
+
+uint8_t xfer_store(uint8_t object, uint32_t offset, const uint8_t* data,
+                   uint8_t len) {
+  // Returns XFER_OK or an error.
+  switch (object) {
+  case XFER_LEDS:
+    if (offset + len > 3 * WSLED_COUNT) {
+      return XFER_RANGE;
+    }
+    anim_stop();
+    wsled_write(offset, data, len);
+    return XFER_OK;
+  default:
+    return XFER_NO_OBJECT;
+  }
+}
+
+void xfer_write(uint8_t id, uint8_t object, uint32_t offset,
+                const uint8_t* data, uint8_t len) {
+  struct xfer_status* s = &xfer_status;
+  uint32_t chunk;
+  uint8_t error;
+
+  if (id != s->id || offset < s->base) {
+    // New transfer
+    s->id = id;
+    s->base = offset;
+    s->received = 0;
+    s->error = XFER_OK;
+  } else if (offset - s->base >= (uint32_t)XFER_WINDOW * XFER_CHUNK) {
+    // The master is happy with the last window
+    s->base = offset;
+    s->received = 0;
+    s->error = XFER_OK;
+  }
+
+  chunk = offset - s->base;
+  if (chunk % XFER_CHUNK) {
+    error = XFER_ALIGN;
+  } else {
+    error = xfer_store(object, offset, data, len);
+  }
+  if (error) {
+    if (!s->error) {
+      s->error = error;
+    }
+    return;
+  }
+  s->received |= (uint32_t)1 << (chunk / XFER_CHUNK);
+}
@@ -0,0 +1,67 @@
+#ifndef XFER_H__
+#define XFER_H__
+
+#include <stdint.h>
+#include "uart.h"
+
+// Chunked transfers
+//
+// Objects larger than a frame are moved in chunks of XFER_CHUNK bytes, each
+// in a frame of its own with a transfer id and the byte offset in the
+// object. All large data goes through here.
+//
+// Reading (parameter 0x30, R): the request is id, object, offset (32 bit)
+// and the number of chunks wanted, at most XFER_WINDOW. The unit replies
+// with that many frames back to back, each with id, offset and the data.
+// The data is sent straight from the object, not copied to a buffer when it
+// is in RAM or flash. A chunk shorter than XFER_CHUNK, possibly empty, is
+// the end of the object. Chunks lost on the way are asked for again by
+// offset.
+//
+// Writing (parameter 0x30, W): each frame is id, object, offset and data,
+// and is never replied to, so the master can send a window of up to
+// XFER_WINDOW chunks without waiting. The data is copied straight into the
+// object. Chunks must be XFER_CHUNK long, except the last. Parameter 0x31
+// then tells which chunks of the window arrived (struct xfer_status), and
+// the master sends the missing ones again. A chunk past the window moves
+// the window to start there. A new id starts a new transfer.
+
+#define XFER_CHUNK 64
+#define XFER_WINDOW 32
+
+// Objects
+#define XFER_FLASH 0 // Program flash, R
+#define XFER_LEDS  1 // Led colors, red, green, blue per led, W
+#define XFER_LOG   2 // Flash log records, R. See flash_log.h.
+#define XFER_SERIES 3 // Time series in RAM, R. See series.h.
+
+// Errors in struct xfer_status
+#define XFER_OK        0
+#define XFER_NO_OBJECT 1 // Object cannot be written
+#define XFER_RANGE     2 // Outside the object
+#define XFER_ALIGN     3 // Offset not at a chunk in the window
+
+// Write window. Laid out as the reply of parameter 0x31.
+struct xfer_status {
+  uint8_t id;
+  uint8_t error;     // XFER_*, first error in the window
+  uint32_t base;     // Offset of the first chunk in the window
+  uint32_t received; // Bit n set when chunk n of the window arrived
+};
+
+extern struct xfer_status xfer_status;
+
+// True if object can be read.
+uint8_t xfer_readable(uint8_t object);
+
+// Point part at up to len bytes of object from offset. Data that is not in
+// RAM or flash is copied to temp.buf, which must not be in use. Returns the
+// number of bytes, 0 at the end.
+uint8_t xfer_read(uint8_t object, uint32_t offset, uint8_t len,
+                  struct uart_part* part);
+
+// Store a chunk written by the master and track it in xfer_status.
+void xfer_write(uint8_t id, uint8_t object, uint32_t offset,
+                const uint8_t* data, uint8_t len);
+
+#endif